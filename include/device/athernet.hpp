@@ -16,6 +16,7 @@ constexpr size_t ATHERNET_MTU = 256;
 struct unix_socket_recv_args {
     int athernet;
     Demultiplexer<PacketBuffer> demultiplexer;
+    bool coalesce; // see `TCPCoalescer`
 };
 
 struct unix_socket_send_args {
@@ -14,7 +14,14 @@
 
 
 namespace cs120 {
-using PacketBuffer = Buffer<uint8_t, 2048>;
+constexpr size_t PACKET_BUFFER_SIZE = 2048;
+
+/// a datagram in a device queue, along with what is known of it but not carried in it
+struct PacketBuffer : public Buffer<uint8_t, PACKET_BUFFER_SIZE> {
+    /// nonzero for a tcp super segment, the payload of each segment it stands for, see
+    /// `tcp_gso_segment` and `TCPCoalescer`, the device resets it once the datagram is sent
+    uint16_t segment_size = 0;
+};
 
 
 template<typename T>
@@ -109,7 +116,8 @@ public:
 
     bool is_close() const { return sender.is_closed() && receivers.empty(); }
 
-    void send(Slice<uint8_t> datagram) {
+    /// `segment_size` goes along to every receiver, see `PacketBuffer`
+    void send(Slice<uint8_t> datagram, uint16_t segment_size = 0) {
         for (;;) {
             auto request = receiver.try_recv();
             if (request.none()) { break; }
@@ -135,6 +143,8 @@ public:
             return;
         }
 
+        IPV4PathMTUCache::get().accept(ip_header, ip_data);
+
         for (auto &recv: receivers) {
             if (!recv->condition(ip_header, ip_option, ip_data)) { continue; }
 
@@ -144,6 +154,7 @@ public:
             } else {
                 auto ip_datagram = (*buffer)[Range{0, ip_header->get_total_length()}];
                 (*slot)[Range{0, ip_datagram.size()}].copy_from_slice(ip_datagram);
+                slot->segment_size = segment_size;
             }
         }
     }
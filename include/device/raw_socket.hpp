@@ -10,6 +10,8 @@
 
 
 namespace cs120 {
+constexpr size_t ETHERNET_MTU = 1500;
+
 class RawSocket : public BaseSocket {
 private:
     pthread_t receiver, sender;
@@ -23,7 +25,7 @@ public:
 
     RawSocket &operator=(RawSocket &&other) noexcept = default;
 
-    uint16_t get_mtu() final { return 1500; }
+    uint16_t get_mtu() final { return ETHERNET_MTU; }
 
     std::pair<MPSCQueue<PacketBuffer>::Sender, Demultiplexer<PacketBuffer>::ReceiverGuard>
     bind(Demultiplexer<PacketBuffer>::Condition &&condition, size_t size) final {
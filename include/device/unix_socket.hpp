@@ -20,7 +20,9 @@ private:
     int athernet;
 
 public:
-    explicit UnixSocket(size_t size);
+    /// segments are only merged on receipt with `coalesce`, which a host forwarding what it
+    /// receives leaves off, the merged ones may not fit the mtu of the way out
+    explicit UnixSocket(size_t size, bool coalesce = true);
 
     UnixSocket(UnixSocket &&other) noexcept = default;
 
@@ -4,16 +4,57 @@
 
 #include <queue>
 #include <vector>
+#include <unordered_set>
 #include <atomic>
 #include <mutex>
 #include <condition_variable>
 #include <chrono>
 #include <memory>
+#include <utility>
 
 #include "utility.hpp"
 
 
 namespace cs120 {
+/// lets one thread wait on several queues at once, a queue holding a waker reports its token
+/// on every commit and when its last sender leaves
+class Waker {
+private:
+    std::mutex lock;
+    std::condition_variable ready;
+    std::unordered_set<size_t> tokens;
+
+public:
+    Waker() : lock{}, ready{}, tokens{} {}
+
+    Waker(const Waker &other) = delete;
+
+    Waker &operator=(const Waker &other) = delete;
+
+    void wake(size_t token) {
+        std::unique_lock<std::mutex> guard{lock};
+        tokens.emplace(token);
+        ready.notify_one();
+    }
+
+    /// tokens woken since the last call, empty if `time` passes first
+    template<typename ClockT, typename DurationT>
+    std::unordered_set<size_t> wait_until(const std::chrono::time_point<ClockT, DurationT> &time) {
+        std::unique_lock<std::mutex> guard{lock};
+
+        while (tokens.empty()) {
+            if (ready.wait_until(guard, time) == std::cv_status::timeout) { break; }
+        }
+
+        std::unordered_set<size_t> result{};
+        result.swap(tokens);
+        return result;
+    }
+
+    ~Waker() = default;
+};
+
+
 template<typename T>
 class MPSCQueue {
 public:
@@ -78,6 +119,57 @@ public:
     };
 
 
+    class SenderBatchGuard {
+    private:
+        MPSCQueue<T> *queue;
+        size_t count;
+        Error error;
+
+    public:
+        explicit SenderBatchGuard(Error error) : queue{nullptr}, count{0}, error{error} {}
+
+        SenderBatchGuard(MPSCQueue<T> *queue, size_t count) :
+                queue{queue}, count{count}, error{Error::None} {}
+
+        SenderBatchGuard(SenderBatchGuard &&other) noexcept :
+                queue{other.queue}, count{other.count}, error{other.error} {
+            other.queue = nullptr;
+            other.count = 0;
+        }
+
+        SenderBatchGuard &operator=(SenderBatchGuard &&other) noexcept {
+            if (this != &other) {
+                if (!this->none()) { queue->commit(count); }
+                this->queue = other.queue;
+                this->count = other.count;
+                this->error = other.error;
+                other.queue = nullptr;
+                other.count = 0;
+            }
+
+            return *this;
+        }
+
+        bool none() const { return queue == nullptr; }
+
+        Error get_error() const { return error; }
+
+        bool is_empty() const { return error == Error::Empty; }
+
+        bool is_close() const { return error == Error::Closed; }
+
+        size_t size() const { return count; }
+
+        T &operator[](size_t index) {
+            if (index >= count) { cs120_abort("index out of boundary!"); }
+
+            return queue->sender_slot(index);
+        }
+
+        ~SenderBatchGuard() { if (!none()) { queue->commit(count); }}
+    };
+
+
     class ReceiverSlotGuard {
     private:
         T *inner;
@@ -162,6 +254,10 @@ public:
 
         SenderSlotGuard send() { return queue->send(); }
 
+        SenderBatchGuard try_send(size_t count) { return queue->try_send(count); }
+
+        SenderBatchGuard send(size_t count) { return queue->send(count); }
+
         ~Sender() { if (queue != nullptr) { queue->remove_sender(); }}
     };
 
@@ -181,6 +277,12 @@ public:
 
         size_t is_closed() const { return queue->sender_count() == 0; }
 
+        bool is_empty() const { return queue->is_empty(); }
+
+        void set_waker(std::shared_ptr<Waker> waker, size_t token) {
+            queue->set_waker(std::move(waker), token);
+        }
+
         ReceiverSlotGuard try_recv() { return queue->try_recv(); }
 
         ReceiverSlotGuard recv() { return queue->recv(); }
@@ -205,12 +307,28 @@ private:
     Array<T> inner;
     size_t size;
     std::atomic<size_t> start, end;
+    std::shared_ptr<Waker> waker;
+    size_t token;
+
+    void wake() { if (waker != nullptr) { waker->wake(token); }}
 
     size_t index_increase(size_t index) const { return index + 1 >= size ? 0 : index + 1; }
 
+    size_t index_increase(size_t index, size_t diff) const {
+        return index + diff >= size ? index + diff - size : index + diff;
+    }
+
+    size_t free_slots() const {
+        size_t start_ = start.load(), end_ = end.load();
+        return start_ > end_ ? start_ - end_ - 1 : size + start_ - end_ - 1;
+    }
+
+    T &sender_slot(size_t offset) { return inner[index_increase(end.load(), offset)]; }
+
     explicit MPSCQueue(size_t size) :
             lock{}, sender_lock{}, receiver_lock{}, empty{}, full{},
-            sender{1}, receiver{1}, inner{size}, size{size}, start{0}, end{0} {}
+            sender{1}, receiver{1}, inner{size}, size{size}, start{0}, end{0},
+            waker{nullptr}, token{0} {}
 
 public:
     static std::pair<Sender, Receiver> channel(size_t size) {
@@ -228,6 +346,7 @@ public:
         if (sender.fetch_sub(1) == 0) {
             std::unique_lock<std::mutex> guard{lock};
             empty.notify_all();
+            wake();
         }
     }
 
@@ -238,8 +357,19 @@ public:
         }
     }
 
+    /// the waker is told of every commit from now on, and once for what is already queued
+    void set_waker(std::shared_ptr<Waker> value, size_t value_token) {
+        std::unique_lock<std::mutex> guard{lock};
+        waker = std::move(value);
+        token = value_token;
+        wake();
+    }
+
     size_t sender_count() const { return sender.load(); }
 
+    /// nothing to receive, only a hint unless called by the receiver
+    bool is_empty() const { return start.load() == end.load(); }
+
     size_t receiver_count() const { return receiver.load(); }
 
     SenderSlotGuard try_send() {
@@ -282,6 +412,53 @@ public:
 
         std::unique_lock<std::mutex> guard{lock};
         empty.notify_one();
+        wake();
+    }
+
+    /// reserve `count` consecutive slots at once, either all of them or none
+    SenderBatchGuard try_send(size_t count) {
+        if (receiver.load() == 0) { return SenderBatchGuard{Error::Closed}; }
+        if (count == 0 || count >= size) { return SenderBatchGuard{Error::Empty}; }
+
+        sender_lock.lock();
+
+        if (free_slots() < count) {
+            sender_lock.unlock();
+            return SenderBatchGuard{Error::Empty};
+        } else {
+            return SenderBatchGuard{this, count};
+        }
+    }
+
+    SenderBatchGuard send(size_t count) {
+        if (receiver.load() == 0) { return SenderBatchGuard{Error::Closed}; }
+        if (count == 0 || count >= size) { return SenderBatchGuard{Error::Empty}; }
+
+        sender_lock.lock();
+
+        if (free_slots() < count) {
+            std::unique_lock<std::mutex> guard{lock};
+
+            while (free_slots() < count) {
+                full.wait(guard);
+
+                if (receiver.load() == 0) {
+                    sender_lock.unlock();
+                    return SenderBatchGuard{Error::Closed};
+                }
+            }
+        }
+
+        return SenderBatchGuard{this, count};
+    }
+
+    void commit(size_t count) {
+        end.store(index_increase(end.load(), count));
+        sender_lock.unlock();
+
+        std::unique_lock<std::mutex> guard{lock};
+        empty.notify_one();
+        wake();
     }
 
     ReceiverSlotGuard try_recv() {
@@ -388,6 +565,216 @@ public:
 
     ~MPSCQueue() = default;
 };
+
+/// single producer, single consumer byte ring, the positions only grow and are published with
+/// release stores, so the two sides exchange data without a lock
+///
+/// a side finding the ring full or empty falls back to a condition variable, which the other
+/// side only touches when someone is waiting on it, or when a waker is watching the ring
+class ByteRing {
+private:
+    Array<uint8_t> buffer;
+    std::atomic<size_t> start;   // written by the consumer only
+    std::atomic<size_t> end;     // written by the producer only
+    std::atomic<bool> closed;
+    std::atomic<size_t> waiters;
+    std::atomic<bool> watched;
+    std::mutex lock;
+    std::condition_variable ready;
+    std::shared_ptr<Waker> waker;
+    size_t token;
+
+    void wake() {
+        // pairs with the fence in `wait`, either the waiter sees the new position or we see it
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_relaxed) == 0 &&
+            !watched.load(std::memory_order_relaxed)) { return; }
+
+        std::unique_lock<std::mutex> guard{lock};
+        ready.notify_all();
+        if (waker != nullptr) { waker->wake(token); }
+    }
+
+    template<typename F>
+    bool wait(F &&condition) {
+        if (condition()) { return true; }
+
+        std::unique_lock<std::mutex> guard{lock};
+
+        waiters.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        while (!condition() && !closed.load()) { ready.wait(guard); }
+
+        waiters.fetch_sub(1);
+
+        return condition();
+    }
+
+    // a range ending at 0 means the whole slice, so the empty cases are skipped by hand
+
+    void copy_in(size_t index, Slice<uint8_t> data) {
+        size_t offset = index % buffer.size();
+        size_t len = std::min(data.size(), buffer.size() - offset);
+
+        if (len > 0) {
+            buffer[Range{offset}][Range{0, len}].copy_from_slice(data[Range{0, len}]);
+        }
+        if (len < data.size()) {
+            buffer[Range{0, data.size() - len}].copy_from_slice(data[Range{len}]);
+        }
+    }
+
+    void copy_out(size_t index, MutSlice<uint8_t> data) const {
+        size_t offset = index % buffer.size();
+        size_t len = std::min(data.size(), buffer.size() - offset);
+
+        if (len > 0) {
+            data[Range{0, len}].copy_from_slice(Slice<uint8_t>{buffer.begin() + offset, len});
+        }
+        if (len < data.size()) {
+            data[Range{len}].copy_from_slice(Slice<uint8_t>{buffer.begin(), data.size() - len});
+        }
+    }
+
+public:
+    /// holds at most `size - 1` bytes
+    explicit ByteRing(size_t size) :
+            buffer{size}, start{0}, end{0}, closed{false}, waiters{0}, watched{false},
+            lock{}, ready{}, waker{nullptr}, token{0} {}
+
+    ByteRing(const ByteRing &other) = delete;
+
+    ByteRing &operator=(const ByteRing &other) = delete;
+
+    size_t capacity() const { return buffer.size() - 1; }
+
+    /// bytes the consumer may read, exact on the consumer side, a lower bound elsewhere
+    size_t readable() const {
+        return end.load(std::memory_order_acquire) - start.load(std::memory_order_relaxed);
+    }
+
+    /// bytes the producer may write, exact on the producer side, a lower bound elsewhere
+    size_t writable() const {
+        return capacity() - (end.load(std::memory_order_relaxed) -
+                             start.load(std::memory_order_acquire));
+    }
+
+    bool is_closed() const { return closed.load(); }
+
+    /// wakes both sides for good, the consumer still drains what is left
+    void close() {
+        closed.store(true);
+
+        std::unique_lock<std::mutex> guard{lock};
+        ready.notify_all();
+        if (waker != nullptr) { waker->wake(token); }
+    }
+
+    /// the waker is told of every commit, consume and close from now on, and once for the
+    /// current state, a null waker stops it
+    void set_waker(std::shared_ptr<Waker> value, size_t value_token) {
+        std::unique_lock<std::mutex> guard{lock};
+        waker = std::move(value);
+        token = value_token;
+        watched.store(waker != nullptr);
+        if (waker != nullptr) { waker->wake(token); }
+    }
+
+    /// producer, block until there is room, false if closed first
+    bool wait_writable() { return wait([this]() { return writable() > 0; }) && !is_closed(); }
+
+    /// producer, copy `data` to `offset` bytes past the end without publishing it,
+    /// `offset + data.size()` must not exceed `writable()`
+    void write_at(size_t offset, Slice<uint8_t> data) {
+        copy_in(end.load(std::memory_order_relaxed) + offset, data);
+    }
+
+    /// producer, the free space after the end, at most `size` bytes, the second region is only
+    /// non empty where the space wraps around, filled in place and then published by `commit`
+    std::pair<MutSlice<uint8_t>, MutSlice<uint8_t>> reserve(size_t size) {
+        size = std::min(size, writable());
+
+        size_t offset = end.load(std::memory_order_relaxed) % buffer.size();
+        size_t len = std::min(size, buffer.size() - offset);
+
+        return std::make_pair(MutSlice<uint8_t>{buffer.begin() + offset, len},
+                              MutSlice<uint8_t>{buffer.begin(), size - len});
+    }
+
+    /// producer, publish `size` more bytes to the consumer
+    void commit(size_t size) {
+        end.store(end.load(std::memory_order_relaxed) + size, std::memory_order_release);
+        wake();
+    }
+
+    /// producer, copy as much of the slices in `data` as fits, in order, and publish it at once
+    size_t writev(Slice<Slice<uint8_t>> data) {
+        size_t room = writable(), size = 0;
+
+        for (auto &slice: data) {
+            size_t len = std::min(slice.size(), room - size);
+            if (len > 0) { write_at(size, slice[Range{0, len}]); }
+
+            size += len;
+            if (size == room) { break; }
+        }
+
+        if (size > 0) { commit(size); }
+
+        return size;
+    }
+
+    size_t write(Slice<uint8_t> data) { return writev(Slice<Slice<uint8_t>>{&data, 1}); }
+
+    /// consumer, block until there is data, false if closed and drained first
+    bool wait_readable() { return wait([this]() { return readable() > 0; }); }
+
+    /// consumer, copy the bytes `offset` past the start into `data` without consuming them,
+    /// `offset + data.size()` must not exceed `readable()`
+    void read_at(size_t offset, MutSlice<uint8_t> data) const {
+        copy_out(start.load(std::memory_order_relaxed) + offset, data);
+    }
+
+    /// consumer, everything readable as it lies in the ring, the second region is only non
+    /// empty where the data wraps around, released by `consume`
+    std::pair<Slice<uint8_t>, Slice<uint8_t>> peek() const {
+        size_t size = readable();
+
+        size_t offset = start.load(std::memory_order_relaxed) % buffer.size();
+        size_t len = std::min(size, buffer.size() - offset);
+
+        return std::make_pair(Slice<uint8_t>{buffer.begin() + offset, len},
+                              Slice<uint8_t>{buffer.begin(), size - len});
+    }
+
+    /// consumer, hand `size` bytes back to the producer
+    void consume(size_t size) {
+        start.store(start.load(std::memory_order_relaxed) + size, std::memory_order_release);
+        wake();
+    }
+
+    /// consumer, fill the slices in `data` in order with what is readable and consume it at once
+    size_t readv(Slice<MutSlice<uint8_t>> data) {
+        size_t ready = readable(), size = 0;
+
+        for (auto slice: data) {
+            size_t len = std::min(slice.size(), ready - size);
+            if (len > 0) { read_at(size, slice[Range{0, len}]); }
+
+            size += len;
+            if (size == ready) { break; }
+        }
+
+        if (size > 0) { consume(size); }
+
+        return size;
+    }
+
+    size_t read(MutSlice<uint8_t> data) { return readv(Slice<MutSlice<uint8_t>>{&data, 1}); }
+
+    ~ByteRing() = default;
+};
 }
 
 
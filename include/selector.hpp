@@ -0,0 +1,149 @@
+#ifndef CS120_SELECTOR_HPP
+#define CS120_SELECTOR_HPP
+
+
+#include <cstdint>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <chrono>
+#include <memory>
+
+#include "utility.hpp"
+#include "queue.hpp"
+
+
+namespace cs120 {
+/// waits for any of several endpoints to get ready, in the manner of `poll`
+///
+/// an endpoint is anything with `is_readable`, `is_writable` and `set_waker`, e.g. a
+/// `TCPClient`, `UDPServer` or `ICMPPing`, readiness is level triggered, an endpoint is reported
+/// by every call while it stays ready, only the endpoints woken since are looked at again
+///
+/// endpoints must stay in place while added, the selector is not thread safe
+class Selector {
+public:
+    using Clock = std::chrono::steady_clock;
+    using TimePoint = Clock::time_point;
+
+    static constexpr uint32_t READABLE = 1;
+    static constexpr uint32_t WRITABLE = 2;
+
+    struct Event {
+        size_t token;
+        uint32_t ready;
+    };
+
+private:
+    struct Entry {
+        void *endpoint;
+        uint32_t interest;
+        uint32_t (*check)(void *endpoint);
+        void (*watch)(void *endpoint, std::shared_ptr<Waker> waker, size_t token);
+    };
+
+    template<typename T>
+    static uint32_t check(void *endpoint) {
+        auto *inner = reinterpret_cast<T *>(endpoint);
+        return (inner->is_readable() ? READABLE : 0) | (inner->is_writable() ? WRITABLE : 0);
+    }
+
+    template<typename T>
+    static void watch(void *endpoint, std::shared_ptr<Waker> waker, size_t token) {
+        reinterpret_cast<T *>(endpoint)->set_waker(std::move(waker), token);
+    }
+
+    std::shared_ptr<Waker> waker;
+    std::unordered_map<size_t, Entry> entries;
+
+    // woken or ready when last looked at, reported ones go to the back so that a short
+    // `events` does not starve the others
+    std::deque<size_t> candidates;
+    std::unordered_set<size_t> queued;
+
+    void enqueue(size_t token) {
+        if (queued.emplace(token).second) { candidates.push_back(token); }
+    }
+
+    size_t poll(MutSlice<Event> events) {
+        size_t count = 0;
+
+        for (size_t i = candidates.size(); i > 0 && count < events.size(); --i) {
+            size_t token = candidates.front();
+            candidates.pop_front();
+
+            auto ptr = entries.find(token);
+            uint32_t ready = ptr == entries.end() ? 0 :
+                             ptr->second.check(ptr->second.endpoint) & ptr->second.interest;
+
+            // the next change of the endpoint wakes it again
+            if (ready == 0) {
+                queued.erase(token);
+                continue;
+            }
+
+            events.begin()[count++] = Event{token, ready};
+            candidates.push_back(token);
+        }
+
+        return count;
+    }
+
+public:
+    Selector() : waker{std::make_shared<Waker>()}, entries{}, candidates{}, queued{} {}
+
+    Selector(const Selector &other) = delete;
+
+    Selector &operator=(const Selector &other) = delete;
+
+    /// watch `endpoint` for `interest` under `token`, which must not be in use
+    template<typename T>
+    void add(T &endpoint, size_t token, uint32_t interest) {
+        if (entries.find(token) != entries.end()) { cs120_abort("token in use!"); }
+
+        entries.emplace(token, Entry{&endpoint, interest, check<T>, watch<T>});
+
+        // the waker is told once for the current state
+        watch<T>(&endpoint, waker, token);
+    }
+
+    void modify(size_t token, uint32_t interest) {
+        auto ptr = entries.find(token);
+        if (ptr == entries.end()) { cs120_abort("unknown token!"); }
+
+        ptr->second.interest = interest;
+        enqueue(token);
+    }
+
+    void remove(size_t token) {
+        auto ptr = entries.find(token);
+        if (ptr == entries.end()) { return; }
+
+        ptr->second.watch(ptr->second.endpoint, nullptr, 0);
+        entries.erase(ptr);
+    }
+
+    bool empty() const { return entries.empty(); }
+
+    /// fill `events` with the endpoints ready for what they are watched for, blocking until
+    /// there is one or `deadline` passes, return the number of events
+    size_t wait(MutSlice<Event> events, TimePoint deadline) {
+        // what is already woken, without blocking
+        auto woken = waker->wait_until(TimePoint{});
+
+        for (;;) {
+            for (auto token: woken) { enqueue(token); }
+
+            size_t count = poll(events);
+            if (count > 0 || Clock::now() >= deadline) { return count; }
+
+            woken = waker->wait_until(deadline);
+        }
+    }
+
+    ~Selector() = default;
+};
+}
+
+
+#endif //CS120_SELECTOR_HPP
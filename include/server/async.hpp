@@ -0,0 +1,206 @@
+#ifndef CS120_ASYNC_HPP
+#define CS120_ASYNC_HPP
+
+
+// the coroutine layer needs c++20, the rest of the stack builds as c++17 without it
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+
+
+#include <coroutine>
+#include <array>
+#include <list>
+#include <unordered_map>
+#include <chrono>
+#include <memory>
+
+#include "selector.hpp"
+#include "server/tcp_server.hpp"
+#include "server/udp_server.hpp"
+#include "server/icmp_server.hpp"
+
+
+namespace cs120 {
+/// a coroutine started at once and never awaited, e.g. one per connection driven by a loop
+struct AsyncTask {
+    struct promise_type {
+        AsyncTask get_return_object() { return {}; }
+
+        std::suspend_never initial_suspend() noexcept { return {}; }
+
+        std::suspend_never final_suspend() noexcept { return {}; }
+
+        void return_void() {}
+
+        void unhandled_exception() { cs120_abort("unhandled exception!"); }
+    };
+};
+
+/// resumes the coroutines waiting on tcp clients, udp servers and pings from one thread
+///
+/// a coroutine waits on an endpoint with an attempt, a non blocking call returning -1 while
+/// it would block, which is tried again whenever a `Selector` finds the endpoint ready for it,
+/// endpoints must stay in place while added
+class AsyncLoop {
+private:
+    struct Waiting {
+        std::coroutine_handle<> handle;
+        uint32_t interest;
+        bool (*retry)(void *awaiter);
+        void *awaiter;
+    };
+
+    Selector selector;
+    size_t next_token;
+    std::unordered_map<const void *, size_t> tokens;
+    std::unordered_map<size_t, std::list<Waiting>> waiting;
+    size_t count; // coroutines suspended
+
+    size_t get_token(const void *endpoint) const {
+        auto ptr = tokens.find(endpoint);
+        if (ptr == tokens.end()) { cs120_abort("endpoint not added!"); }
+
+        return ptr->second;
+    }
+
+    /// the selector only watches an endpoint for what its coroutines wait on
+    void update(size_t token) {
+        uint32_t interest = 0;
+        for (auto &item: waiting[token]) { interest |= item.interest; }
+
+        selector.modify(token, interest);
+    }
+
+    template<typename F>
+    class Awaiter {
+    private:
+        AsyncLoop *loop;
+        size_t token;
+        uint32_t interest;
+        F attempt;
+        ssize_t result;
+
+        static bool retry(void *self) {
+            auto *awaiter = reinterpret_cast<Awaiter *>(self);
+            awaiter->result = awaiter->attempt();
+            return awaiter->result != -1;
+        }
+
+    public:
+        Awaiter(AsyncLoop *loop, size_t token, uint32_t interest, F &&attempt) :
+                loop{loop}, token{token}, interest{interest}, attempt{std::move(attempt)},
+                result{-1} {}
+
+        bool await_ready() { return retry(this); }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+            loop->waiting[token].push_back(Waiting{handle, interest, retry, this});
+            loop->update(token);
+            ++loop->count;
+        }
+
+        ssize_t await_resume() const { return result; }
+    };
+
+    template<typename F>
+    Awaiter<F> until(const void *endpoint, uint32_t interest, F &&attempt) {
+        return Awaiter<F>{this, get_token(endpoint), interest, std::forward<F>(attempt)};
+    }
+
+public:
+    AsyncLoop() : selector{}, next_token{0}, tokens{}, waiting{}, count{0} {}
+
+    AsyncLoop(const AsyncLoop &other) = delete;
+
+    AsyncLoop &operator=(const AsyncLoop &other) = delete;
+
+    template<typename T>
+    void add(T &endpoint) {
+        tokens[&endpoint] = next_token;
+        selector.add(endpoint, next_token++, 0);
+    }
+
+    /// no coroutine may still wait on the endpoint
+    template<typename T>
+    void remove(T &endpoint) {
+        size_t token = get_token(&endpoint);
+
+        selector.remove(token);
+        waiting.erase(token);
+        tokens.erase(&endpoint);
+    }
+
+    /// `co_await` to 0 once the handshake is over, -1 never comes back
+    auto connect(TCPClient &client) {
+        return until(&client, Selector::READABLE | Selector::WRITABLE,
+                     [&client]() -> ssize_t { return client.is_connecting() ? -1 : 0; });
+    }
+
+    auto send(TCPClient &client, Slice<uint8_t> data) {
+        return until(&client, Selector::WRITABLE,
+                     [&client, data]() { return client.try_send(data); });
+    }
+
+    auto recv(TCPClient &client, MutSlice<uint8_t> data) {
+        return until(&client, Selector::READABLE,
+                     [&client, data]() { return client.try_recv(data); });
+    }
+
+    auto send(UDPServer &server, Slice<uint8_t> data) {
+        return until(&server, Selector::WRITABLE,
+                     [&server, data]() { return server.try_send(data); });
+    }
+
+    auto recv(UDPServer &server, MutSlice<uint8_t> data) {
+        return until(&server, Selector::READABLE,
+                     [&server, data]() { return server.try_recv(data); });
+    }
+
+    /// `co_await` to the sequence of the next echo reply
+    auto reply(ICMPPing &ping) {
+        return until(&ping, Selector::READABLE,
+                     [&ping]() -> ssize_t { return ping.try_reply(); });
+    }
+
+    /// resume coroutines as their endpoints get ready, until none is suspended any more
+    void run() {
+        std::array<Selector::Event, 16> events{};
+
+        while (count > 0) {
+            size_t size = selector.wait(MutSlice<Selector::Event>{events.data(), events.size()},
+                                        Selector::Clock::now() + std::chrono::seconds{1});
+
+            for (size_t i = 0; i < size; ++i) {
+                size_t token = events[i].token;
+
+                auto ptr = waiting.find(token);
+                if (ptr == waiting.end()) { continue; }
+
+                // coroutines resumed here may wait on the same token again
+                std::list<Waiting> current{};
+                current.swap(ptr->second);
+
+                for (auto &item: current) {
+                    if ((item.interest & events[i].ready) == 0 || !item.retry(item.awaiter)) {
+                        waiting[token].push_back(item);
+                        continue;
+                    }
+
+                    --count;
+                    item.handle.resume();
+                }
+
+                // the endpoint may be removed by now
+                if (waiting.find(token) != waiting.end()) { update(token); }
+            }
+        }
+    }
+
+    ~AsyncLoop() = default;
+};
+}
+
+
+#endif
+
+
+#endif //CS120_ASYNC_HPP
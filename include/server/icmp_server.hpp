@@ -19,6 +19,11 @@ private:
     uint16_t src_port, dest_port;
     uint16_t identification;
 
+    void generate_request(MutSlice<uint8_t> frame, uint16_t seq);
+
+    /// sequence of the echo reply in `datagram`, -1 if it is not a valid one
+    static int32_t parse_reply(Slice<uint8_t> datagram);
+
 public:
     ICMPPing(MPSCQueue<PacketBuffer>::Sender send_queue, Demultiplexer<PacketBuffer>::ReceiverGuard recv_queue,
              uint32_t src_ip, uint32_t dest_ip, uint16_t src_port, uint16_t dest_port,
@@ -27,7 +32,25 @@ public:
             src_ip{src_ip}, dest_ip{dest_ip}, src_port{src_port}, dest_port{dest_port},
             identification{identification} {}
 
+    /// send the echo request `seq` and wait a second for its reply
     bool ping(uint16_t seq);
+
+    /// send the echo request `seq`, false if the device queue is full or gone
+    bool request(uint16_t seq);
+
+    /// sequence of an echo reply that has arrived, -1 if none has
+    int32_t try_reply();
+
+    /// `try_reply` has something to look at
+    bool is_readable() { return !recv_queue->is_empty() || recv_queue->is_closed(); }
+
+    /// the device queue tells no one when it has room again, so sending always counts as ready
+    bool is_writable() const { return true; }
+
+    /// `waker` is told under `token` whenever a reply arrives, and once for those already here
+    void set_waker(std::shared_ptr<Waker> waker, size_t token) {
+        recv_queue->set_waker(std::move(waker), token);
+    }
 };
 
 class ICMPServer {
@@ -5,24 +5,32 @@
 #include <type_traits>
 #include <unordered_map>
 #include <map>
+#include <atomic>
+#include <random>
+#include <mutex>
+#include <chrono>
 
 #include "queue.hpp"
+#include "timing_wheel.hpp"
 #include "wire/ipv4.hpp"
+#include "wire/icmp.hpp"
 
 
 namespace cs120 {
 struct IPV4FragmentTag {
     uint32_t src_ip, dest_ip;
     uint16_t identification;
+    IPV4Protocol protocol;
 
     explicit IPV4FragmentTag(const IPV4Header &header) :
             src_ip{header.get_src_ip()}, dest_ip{header.get_dest_ip()},
-            identification{header.get_identification()} {}
+            identification{header.get_identification()}, protocol{header.get_protocol()} {}
 
     bool operator==(const IPV4FragmentTag &other) const {
         return this->src_ip == other.src_ip &&
                this->dest_ip == other.dest_ip &&
-               this->identification == other.identification;
+               this->identification == other.identification &&
+               this->protocol == other.protocol;
     }
 };
 }
@@ -33,12 +41,152 @@ struct std::hash<cs120::IPV4FragmentTag> {
     size_t operator()(const cs120::IPV4FragmentTag &object) const {
         return std::hash<uint64_t>{}(static_cast<uint64_t>(object.src_ip) |
                                      (static_cast<uint64_t>(object.dest_ip) << 32)) ^
-               std::hash<uint16_t>{}(object.identification);
+               std::hash<uint32_t>{}(static_cast<uint32_t>(object.identification) |
+                                     (static_cast<uint32_t>(object.protocol) << 16));
     }
 };
 
 
 namespace cs120 {
+/// RFC 6864
+/// Lock-free identification allocator shared by every sender in the process. Each
+/// (src, dest, protocol) triple is hashed to a counter, so fragmented datagrams of concurrent
+/// flows to the same peer never reuse an identification within the counter period.
+class IPV4IdentificationGenerator {
+private:
+    static constexpr size_t BUCKET_SIZE = 1024;
+
+    std::atomic<uint16_t> buckets[BUCKET_SIZE];
+
+    IPV4IdentificationGenerator() noexcept {
+        std::random_device device{};
+        for (auto &bucket: buckets) { bucket.store(static_cast<uint16_t>(device())); }
+    }
+
+    static size_t hash(uint32_t src_ip, uint32_t dest_ip, IPV4Protocol protocol) {
+        uint64_t key = (static_cast<uint64_t>(src_ip) << 32 | dest_ip) ^
+                       static_cast<uint64_t>(protocol);
+        key *= 0x9e3779b97f4a7c15ull;
+        return static_cast<size_t>(key >> 32) % BUCKET_SIZE;
+    }
+
+public:
+    static IPV4IdentificationGenerator &get() {
+        static IPV4IdentificationGenerator instance{};
+        return instance;
+    }
+
+    IPV4IdentificationGenerator(const IPV4IdentificationGenerator &other) = delete;
+
+    IPV4IdentificationGenerator &operator=(const IPV4IdentificationGenerator &other) = delete;
+
+    /// the first of `count` identifications in a row, one for each datagram a super segment
+    /// is cut into
+    uint16_t next(uint32_t src_ip, uint32_t dest_ip, IPV4Protocol protocol, uint16_t count = 1) {
+        return buckets[hash(src_ip, dest_ip, protocol)].fetch_add(count,
+                                                                  std::memory_order_relaxed);
+    }
+};
+
+
+/// RFC 1191
+/// Path MTU of each destination, learned from incoming ICMP "datagram too big" messages. An
+/// entry ages out after `AGING`, after which the local device MTU is tried again.
+class IPV4PathMTUCache {
+private:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr Clock::duration AGING = std::chrono::minutes{10};
+    static constexpr uint16_t MINIMUM_MTU = 68;
+
+    std::mutex lock;
+    std::atomic<size_t> size;
+    std::unordered_map<uint32_t, std::pair<uint16_t, Clock::time_point>> inner;
+
+    IPV4PathMTUCache() noexcept: lock{}, size{0}, inner{} {}
+
+    /// plateau table of RFC 1191, for routers which do not report the next hop mtu
+    static uint16_t plateau(size_t total_length) {
+        static constexpr uint16_t TABLE[] = {
+                32000, 17914, 8166, 4352, 2002, 1492, 1006, 508, 296, MINIMUM_MTU
+        };
+
+        for (auto mtu: TABLE) { if (mtu < total_length) { return mtu; } }
+
+        return MINIMUM_MTU;
+    }
+
+public:
+    static IPV4PathMTUCache &get() {
+        static IPV4PathMTUCache instance{};
+        return instance;
+    }
+
+    IPV4PathMTUCache(const IPV4PathMTUCache &other) = delete;
+
+    IPV4PathMTUCache &operator=(const IPV4PathMTUCache &other) = delete;
+
+    /// mtu towards `dest_ip`, never larger than the mtu of the local device
+    uint16_t query(uint32_t dest_ip, uint16_t mtu) {
+        if (size.load(std::memory_order_relaxed) == 0) { return mtu; }
+
+        std::unique_lock<std::mutex> guard{lock};
+
+        auto ptr = inner.find(dest_ip);
+        if (ptr == inner.end()) { return mtu; }
+
+        if (Clock::now() - ptr->second.second > AGING) {
+            inner.erase(ptr);
+            size.store(inner.size(), std::memory_order_relaxed);
+            return mtu;
+        }
+
+        return std::min(mtu, ptr->second.first);
+    }
+
+    void update(uint32_t dest_ip, uint16_t mtu) {
+        mtu = std::max(mtu, MINIMUM_MTU);
+
+        std::unique_lock<std::mutex> guard{lock};
+
+        auto now = Clock::now();
+        auto ptr = inner.find(dest_ip);
+        if (ptr == inner.end()) {
+            inner.emplace(dest_ip, std::make_pair(mtu, now));
+            size.store(inner.size(), std::memory_order_relaxed);
+        } else if (mtu < ptr->second.first || now - ptr->second.second > AGING) {
+            ptr->second = std::make_pair(mtu, now);
+        }
+    }
+
+    /// feed a received datagram, return true if it is a "datagram too big" message
+    bool accept(const IPV4Header *ip_header, Slice<uint8_t> ip_data) {
+        if (ip_header->get_protocol() != IPV4Protocol::ICMP) { return false; }
+
+        auto[icmp_header, icmp_data] = icmp_split(ip_data);
+        if (icmp_header == nullptr ||
+            icmp_header->get_type() != ICMPType::Unreachable ||
+            icmp_header->get_code() != ICMPUnreachable::DatagramTooBig ||
+            icmp_data.size() < sizeof(ICMPUnreachable) + sizeof(IPV4Header) ||
+            complement_checksum(ip_data) != 0) { return false; }
+
+        // both lengths are checked above
+        auto *unreachable = reinterpret_cast<const ICMPUnreachable *>(icmp_data.begin());
+
+        // only the header and first 8 bytes of the original datagram are echoed back
+        auto *origin = reinterpret_cast<const IPV4Header *>(
+                icmp_data[Range{sizeof(ICMPUnreachable)}].begin());
+
+        uint16_t mtu = unreachable->get_next_hop_mtu();
+        if (mtu == 0) { mtu = plateau(origin->get_total_length()); }
+
+        update(origin->get_dest_ip(), mtu);
+
+        return true;
+    }
+};
+
+
 // todo: handle ip option
 
 template<typename T>
@@ -47,31 +195,36 @@ class IPV4FragmentSender {
 
 private:
     typename MPSCQueue<T>::Sender inner;
-    size_t mtu;
+    uint16_t mtu;
 
 public:
     IPV4FragmentSender() noexcept: inner{}, mtu{0} {}
 
     IPV4FragmentSender(typename MPSCQueue<T>::Sender &&inner, uint16_t mtu) :
-            inner{std::move(inner)}, mtu{IPV4Header::max_payload(mtu)} {}
+            inner{std::move(inner)}, mtu{mtu} {}
 
     typename MPSCQueue<T>::Sender &operator*() { return inner; }
 
     typename MPSCQueue<T>::Sender *operator->() { return &inner; }
 
+    /// the datagram is either sent as a whole burst of fragments, or not sent at all (return 0)
     size_t send(uint8_t type_of_service, uint16_t identification, IPV4Protocol protocol,
                 uint32_t src_ip, uint32_t dest_ip,
                 size_t offset, bool do_not_fragment, bool more_fragment,
                 uint8_t time_to_live, Slice<uint8_t> data) {
-        for (size_t start = 0, size; start < data.size(); start += size) {
+        if (data.empty()) { return sizeof(IPV4Header); }
+
+        size_t mtu = IPV4Header::max_payload(IPV4PathMTUCache::get().query(dest_ip, this->mtu));
+
+        auto buffer = inner.try_send(divide_ceil(data.size(), mtu));
+        if (buffer.none()) { return 0; }
+
+        for (size_t i = 0, start = 0, size; start < data.size(); ++i, start += size) {
             size = std::min(mtu, data.size() - start);
 
             bool fragment = more_fragment || start + size < data.size();
 
-            auto buffer = inner.try_send();
-            if (buffer.none()) { return sizeof(IPV4Header) + start; }
-
-            IPV4Header::generate((*buffer)[Range{}], type_of_service, identification, protocol,
+            IPV4Header::generate(buffer[i][Range{}], type_of_service, identification, protocol,
                                  src_ip, dest_ip, offset + start, do_not_fragment, fragment,
                                  time_to_live, size)
                     .copy_from_slice(data[Range{start}][Range{0, size}]);
@@ -212,10 +365,14 @@ private:
         }
     };
 
+    /// datagrams missing a fragment for this long are dropped, as linux does
+    static constexpr std::chrono::seconds REASSEMBLY_TIMEOUT{30};
+
     std::unordered_map<IPV4FragmentTag, Fragment> fragments;
+    TimingWheel<IPV4FragmentTag> expire;
 
 public:
-    IPV4FragmentReceiver() noexcept: fragments{} {}
+    IPV4FragmentReceiver() : fragments{}, expire{} {}
 
     ReceiverSlotGuard recv(Slice<uint8_t> buffer) {
         auto[ip_header, ip_option, ip_data] = ipv4_split(buffer);
@@ -227,11 +384,15 @@ public:
             return ReceiverSlotGuard{buffer};
         }
 
+        auto current = TimingWheel<IPV4FragmentTag>::Clock::now();
+        expire.advance(current, [&](const IPV4FragmentTag &tag) { fragments.erase(tag); });
+
         IPV4FragmentTag tag{*ip_header};
 
         auto ptr = fragments.find(tag);
         if (ptr == fragments.end()) {
             ptr = fragments.emplace(tag, Fragment{*ip_header}).first;
+            expire.schedule(tag, current + REASSEMBLY_TIMEOUT);
         }
 
         switch (ptr->second.insert(ip_header, ip_option, ip_data)) {
@@ -240,10 +401,12 @@ public:
             case Fragment::InsertResult::Complete: {
                 auto data = ptr->second.take();
                 fragments.erase(ptr);
+                expire.cancel(tag);
                 return ReceiverSlotGuard{std::move(data)};
             }
             case Fragment::InsertResult::Error:
                 fragments.erase(ptr);
+                expire.cancel(tag);
                 break;
             default:
                 cs120_unreachable("");
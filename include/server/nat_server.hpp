@@ -6,6 +6,8 @@
 #include <atomic>
 #include <unordered_map>
 #include <mutex>
+#include <vector>
+#include <chrono>
 
 #include "device/base_socket.hpp"
 #include "wire/wire.hpp"
@@ -13,6 +15,7 @@
 #include "wire/icmp.hpp"
 #include "wire/udp.hpp"
 #include "wire/tcp.hpp"
+#include "timing_wheel.hpp"
 #include "ipv4_server.hpp"
 
 
@@ -33,6 +36,11 @@ private:
 
     void nat_wan_to_lan();
 
+    /// wan port for `end_point`, a new mapping if it has none
+    uint16_t nat_map(EndPoint end_point);
+
+    void nat_unmap(uint16_t wan_port);
+
     pthread_t lan_to_wan, wan_to_lan;
     std::shared_ptr<BaseSocket> lan, wan;
 
@@ -42,6 +50,9 @@ private:
     Array<std::atomic<EndPoint>> nat_table; // shared between lan to wan and wan to lan
     std::unordered_map<EndPoint, uint16_t> nat_reverse_table;
     size_t lowest_free_port;
+    size_t dynamic_ports_base;
+    std::vector<uint16_t> free_ports;           // released by aging, reused first
+    TimingWheel<uint16_t> nat_aging;            // dynamic mappings only, owned by lan to wan
 
     uint32_t wan_addr;
 
@@ -49,6 +60,12 @@ public:
     static const uint16_t NAT_PORTS_BASE = 50000;
     static const uint16_t NAT_PORTS_SIZE = 1024;
 
+    /// idle time before a dynamic mapping is released, refreshed by outbound traffic
+    /// (RFC 5508 for icmp, RFC 4787 for udp, RFC 5382 for tcp)
+    static constexpr std::chrono::seconds ICMP_TIMEOUT{60};
+    static constexpr std::chrono::seconds UDP_TIMEOUT{300};
+    static constexpr std::chrono::seconds TCP_TIMEOUT{7440};
+
     NatServer(uint32_t lan_addr, uint32_t wan_addr,
               std::shared_ptr<BaseSocket> &lan, std::shared_ptr<BaseSocket> &wan,
               size_t size, const Array<EndPoint> &map_addr);
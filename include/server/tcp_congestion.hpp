@@ -0,0 +1,154 @@
+#ifndef CS120_TCP_CONGESTION_HPP
+#define CS120_TCP_CONGESTION_HPP
+
+
+#include <cstdint>
+#include <array>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+
+
+namespace cs120 {
+enum class TCPCongestionAlgorithm {
+    Reno,
+    Cubic,
+    Delay,
+};
+
+/// congestion window of one connection, driven by its `TCPConnection`
+///
+/// the window inflation of fast recovery is kept by the sender, modules only see the ack
+/// stream outside of recovery
+class TCPCongestionControl {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Duration = std::chrono::microseconds;
+
+protected:
+    uint32_t mss, window, threshold;
+
+public:
+    TCPCongestionControl(uint32_t mss, uint32_t threshold) :
+            mss{mss}, window{mss}, threshold{std::max(threshold, mss)} {}
+
+    static std::unique_ptr<TCPCongestionControl>
+    create(TCPCongestionAlgorithm algorithm, uint32_t mss, uint32_t threshold);
+
+    uint32_t get_window() const { return window; }
+
+    void set_mss(uint32_t value) { mss = value; }
+
+    /// new data is about to leave with `flight` bytes outstanding
+    virtual void on_send(uint32_t flight) { (void) flight; }
+
+    /// `acked` bytes are newly acknowledged with `flight` bytes still outstanding,
+    /// `rtt` is the round trip time sampled from this ack, zero if there is none
+    virtual void on_ack(uint32_t acked, uint32_t flight, Duration rtt) = 0;
+
+    /// loss detected by duplicate acknowledgements, fast recovery follows
+    virtual void on_loss(uint32_t flight) = 0;
+
+    virtual void on_rto(uint32_t flight) = 0;
+
+    /// bytes per second to spread the segments over, zero to send as soon as the window allows
+    virtual uint64_t pacing_rate() const { return 0; }
+
+    virtual ~TCPCongestionControl() = default;
+};
+
+/// RFC 5681, slow start and additive increase
+class TCPReno : public TCPCongestionControl {
+private:
+    uint32_t transmitted;
+
+public:
+    TCPReno(uint32_t mss, uint32_t threshold) :
+            TCPCongestionControl{mss, threshold / mss * mss}, transmitted{0} {}
+
+    void on_ack(uint32_t acked, uint32_t flight, Duration rtt) override;
+
+    void on_loss(uint32_t flight) override;
+
+    void on_rto(uint32_t flight) override;
+};
+
+/// RFC 9438, window growth by a cubic function of the time since the last reduction
+class TCPCubic : public TCPCongestionControl {
+private:
+    static constexpr double C = 0.4;
+    static constexpr double BETA = 0.7;
+
+    double last_max;      // window before the last reduction, in bytes
+    double k;             // seconds to grow back to `last_max`
+    double estimate;      // window a reno flow would have, in bytes
+    bool epoch_started;
+    Clock::time_point epoch;
+    Duration min_rtt;
+
+    void reduce();
+
+public:
+    TCPCubic(uint32_t mss, uint32_t threshold) :
+            TCPCongestionControl{mss, threshold}, last_max{0}, k{0}, estimate{0},
+            epoch_started{false}, epoch{}, min_rtt{0} {}
+
+    void on_ack(uint32_t acked, uint32_t flight, Duration rtt) override;
+
+    void on_loss(uint32_t flight) override;
+
+    void on_rto(uint32_t flight) override;
+};
+
+/// model based control in the manner of BBR, the window follows the measured bandwidth-delay
+/// product instead of backing off on loss, fitting the long and lossy acoustic link
+class TCPDelay : public TCPCongestionControl {
+private:
+    enum class State {
+        Startup,
+        Drain,
+        ProbeBandwidth,
+    };
+
+    static constexpr double STARTUP_GAIN = 2.885;   // 2 / ln(2)
+    static constexpr double WINDOW_GAIN = 2.0;
+    static constexpr size_t BANDWIDTH_ROUNDS = 10;
+    static constexpr std::array<double, 8> PROBE_GAIN{1.25, 0.75, 1, 1, 1, 1, 1, 1};
+    static constexpr std::chrono::seconds MIN_RTT_EXPIRE{10};
+
+    State state;
+    std::array<double, BANDWIDTH_ROUNDS> samples; // delivery rate of the latest rounds
+    size_t round;
+    double bandwidth;                             // bytes per second
+    double full_bandwidth;
+    size_t full_bandwidth_count;
+    Duration min_rtt;
+    Clock::time_point min_rtt_stamp;
+    uint32_t delivered;
+    Clock::time_point round_start;
+    size_t cycle;
+
+    uint32_t get_target(double gain) const;
+
+    void on_round(uint32_t flight);
+
+public:
+    TCPDelay(uint32_t mss, uint32_t threshold) :
+            TCPCongestionControl{mss, threshold}, state{State::Startup}, samples{}, round{0},
+            bandwidth{0}, full_bandwidth{0}, full_bandwidth_count{0}, min_rtt{0},
+            min_rtt_stamp{}, delivered{0}, round_start{Clock::now()}, cycle{0} {}
+
+    void on_send(uint32_t flight) override;
+
+    void on_ack(uint32_t acked, uint32_t flight, Duration rtt) override;
+
+    void on_loss(uint32_t flight) override;
+
+    void on_rto(uint32_t flight) override;
+
+    uint64_t pacing_rate() const override;
+};
+}
+
+
+#endif //CS120_TCP_CONGESTION_HPP
@@ -4,50 +4,306 @@
 
 #include "pthread.h"
 #include <list>
+#include <deque>
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <unordered_map>
+#include <random>
 
 #include "device/base_socket.hpp"
+#include "device/athernet.hpp"
 #include "wire/tcp.hpp"
+#include "server/tcp_congestion.hpp"
 #include "ipv4_server.hpp"
 
 
 namespace cs120 {
-// todo
-constexpr uint16_t IDENTIFIER = 0;
+/// sack blocks passed between the protocol threads, `[begin, end)` in host byte order
+struct TCPSACKBlocks {
+    uint32_t size;
+    uint32_t blocks[TCPOptionSACK::MAX_BLOCKS][2];
+
+    bool push(uint32_t begin, uint32_t end) {
+        if (size >= TCPOptionSACK::MAX_BLOCKS) { return false; }
+
+        blocks[size][0] = begin;
+        blocks[size][1] = end;
+        ++size;
+
+        return true;
+    }
+
+    TCPOptionSACK into_option() const {
+        TCPOptionSACK option{};
+        for (size_t i = 0; i < size; ++i) { option.push(blocks[i][0], blocks[i][1]); }
+        return option;
+    }
+};
+
+/// options of a segment after the handshake, at most the 40 bytes a tcp header can hold
+struct TCPSegmentOption {
+    static constexpr size_t MAX_SIZE = 40;
+
+    uint8_t buffer[MAX_SIZE];
+    size_t size;
+
+    void push(Slice<uint8_t> option) {
+        if (size + option.size() > MAX_SIZE) { cs120_abort("tcp option overflow!"); }
+
+        memcpy(buffer + size, option.begin(), option.size());
+        size += option.size();
+    }
+
+    Slice<uint8_t> into_slice() const { return Slice<uint8_t>{buffer, size}; }
+};
+
+/// RFC 7323, timestamp clock in milliseconds
+inline uint32_t tcp_timestamp() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// RFC 6298, retransmission timeout from the smoothed round trip time
+class TCPRetransmissionTimer {
+public:
+    using Duration = std::chrono::microseconds;
+
+    static constexpr Duration INITIAL = std::chrono::seconds{1};
+    static constexpr Duration MINIMUM = std::chrono::milliseconds{200};
+    static constexpr Duration MAXIMUM = std::chrono::seconds{60};
+    static constexpr Duration GRANULARITY = std::chrono::milliseconds{1};
+
+private:
+    Duration srtt, rttvar, rto;
+    bool measured;
+
+public:
+    TCPRetransmissionTimer() : srtt{0}, rttvar{0}, rto{INITIAL}, measured{false} {}
+
+    void sample(Duration rtt) {
+        if (!measured) {
+            srtt = rtt;
+            rttvar = rtt / 2;
+            measured = true;
+        } else {
+            Duration delta = srtt > rtt ? srtt - rtt : rtt - srtt;
+            rttvar = (rttvar * 3 + delta) / 4;
+            srtt = (srtt * 7 + rtt) / 8;
+        }
+
+        rto = std::min(std::max(srtt + std::max(GRANULARITY, rttvar * 4), MINIMUM), MAXIMUM);
+    }
+
+    /// exponential backoff, kept until the next sample
+    void backoff() { rto = std::min(rto * 2, MAXIMUM); }
+
+    Duration get_rto() const { return rto; }
+};
+
+/// disjoint `[seq, end)` sequence ranges kept sorted from a moving `base` in a fixed array,
+/// ranges touching or overlapping are merged as they come
+///
+/// a window holds only a handful of holes, so shifting a few entries beats allocating nodes
+class TCPSequenceRanges {
+public:
+    struct Entry {
+        uint32_t seq, end;
+    };
+
+private:
+    Array<Entry> inner;
+    size_t size_;
+
+public:
+    explicit TCPSequenceRanges(size_t capacity) : inner{capacity}, size_{0} {}
+
+    bool empty() const { return size_ == 0; }
+
+    size_t size() const { return size_; }
+
+    const Entry *begin() const { return inner.begin(); }
+
+    const Entry *end() const { return inner.begin() + size_; }
+
+    const Entry &front() const { return begin()[0]; }
+
+    const Entry &back() const { return end()[-1]; }
+
+    void clear() { size_ = 0; }
+
+    void pop_front() {
+        std::copy(inner.begin() + 1, inner.begin() + size_, inner.begin());
+        --size_;
+    }
+
+    /// drops the ranges ending at or before `seq`
+    void trim(uint32_t seq) {
+        size_t count = 0;
+        while (count < size_ && !tcp_seq_before(seq, inner[count].end)) { ++count; }
+
+        std::copy(inner.begin() + count, inner.begin() + size_, inner.begin());
+        size_ -= count;
+    }
+
+    /// adds `[seq, end)`, no range may start before `base`, returns the range it ends up in,
+    /// or `nullptr` when a new range is needed but the array is full
+    const Entry *insert(uint32_t base, uint32_t seq, uint32_t end) {
+        auto *first = inner.begin(), *last = inner.begin() + size_;
+
+        auto *low = std::lower_bound(first, last, seq, [=](const Entry &entry, uint32_t value) {
+            return entry.end - base < value - base;
+        });
+        auto *high = std::upper_bound(low, last, end, [=](uint32_t value, const Entry &entry) {
+            return value - base < entry.seq - base;
+        });
+
+        if (low == high) {
+            if (size_ == inner.size()) { return nullptr; }
+
+            std::copy_backward(low, last, last + 1);
+            *low = Entry{seq, end};
+            ++size_;
+
+            return low;
+        }
+
+        if (low->seq - base < seq - base) { seq = low->seq; }
+        if (end - base < (high - 1)->end - base) { end = (high - 1)->end; }
+
+        *low = Entry{seq, end};
+        std::copy(high, last, low + 1);
+        size_ -= high - low - 1;
+
+        return low;
+    }
+};
+
+/// RFC 7323, smallest shift which lets the window field cover a buffer of `size` bytes
+inline uint8_t tcp_window_scale(size_t size) {
+    uint8_t scale = 0;
+    while (scale < TCPOptionScale::MAX_SCALE && ((size - 1) >> scale) > 0xffff) { ++scale; }
+    return scale;
+}
+
+/// RFC 4987, the isn of a syn ack which records what the syn offered, so that a listener keeps
+/// no state until the handshake completes
+///
+/// from the high bits, a counter of `PERIOD`s (5 bits), the index of the remote mss in
+/// `MSS_TABLE` (2 bits), the window scale of the remote or `NO_SCALE` (4 bits), sack permitted
+/// (1 bit), and a keyed hash of the rest and the connection (20 bits)
+class TCPSyncCookie {
+public:
+    using Clock = std::chrono::steady_clock;
+    using TimePoint = Clock::time_point;
+
+    static constexpr std::chrono::seconds PERIOD{64};
+    static constexpr uint8_t NO_SCALE = 15;
+
+    /// the largest entry not above the mss offered is encoded, 536 when none is offered, the
+    /// full sized segments of the athernet and ethernet devices are kept exactly
+    static constexpr uint16_t MSS_TABLE[4] = {
+            64, TCPHeader::max_payload(ATHERNET_MTU - 1), TCPOptionMSS::DEFAULT,
+            TCPHeader::max_payload(ETHERNET_MTU)
+    };
+
+    static_assert(MSS_TABLE[0] < MSS_TABLE[1] && MSS_TABLE[1] < MSS_TABLE[2] &&
+                  MSS_TABLE[2] < MSS_TABLE[3], "the mss table is searched in order");
+
+    struct Option {
+        uint16_t mss;
+        uint8_t scale;
+        bool sack;
+    };
+
+private:
+    uint64_t secret;
+
+    static uint32_t get_counter(TimePoint current) {
+        return static_cast<uint32_t>(current.time_since_epoch() / PERIOD) & 0x1f;
+    }
+
+    uint32_t hash(EndPoint local, EndPoint remote, uint32_t remote_isn, uint32_t fields) const {
+        uint64_t key = secret;
+
+        for (uint64_t word: {static_cast<uint64_t>(local.ip_addr) << 16 | local.port,
+                             static_cast<uint64_t>(remote.ip_addr) << 16 | remote.port,
+                             static_cast<uint64_t>(remote_isn) << 12 | fields}) {
+            key = (key ^ word) * 0x9e3779b97f4a7c15ull;
+            key ^= key >> 29;
+        }
+
+        return static_cast<uint32_t>(key >> 44);
+    }
+
+public:
+    TCPSyncCookie() : secret{0} {
+        std::random_device device{};
+        secret = static_cast<uint64_t>(device()) << 32 | device();
+    }
+
+    uint32_t encode(EndPoint local, EndPoint remote, uint32_t remote_isn, Option option,
+                    TimePoint current) const {
+        uint32_t mss = 0;
+        while (mss < 3 && MSS_TABLE[mss + 1] <= option.mss) { ++mss; }
+
+        uint32_t fields = get_counter(current) << 7 | mss << 5 |
+                          static_cast<uint32_t>(option.scale & 0xf) << 1 | option.sack;
+
+        return fields << 20 | hash(local, remote, remote_isn, fields);
+    }
+
+    /// whether `cookie` was made by `encode` for this connection in the last two periods
+    bool decode(EndPoint local, EndPoint remote, uint32_t remote_isn, uint32_t cookie,
+                TimePoint current, Option &option) const {
+        uint32_t fields = cookie >> 20;
+
+        if (((get_counter(current) - (fields >> 7)) & 0x1f) > 1) { return false; }
+        if (hash(local, remote, remote_isn, fields) != (cookie & 0xfffff)) { return false; }
+
+        option = Option{MSS_TABLE[(fields >> 5) & 0x3], static_cast<uint8_t>((fields >> 1) & 0xf),
+                        (fields & 1) != 0};
+        return true;
+    }
+};
 
 class TCPSender {
 public:
-    static constexpr size_t BUFFER_SIZE = 1 << 16;
+    static constexpr size_t DEFAULT_BUFFER_SIZE = 1 << 16;
+    static constexpr std::chrono::milliseconds ACK_DELAY{40};
 
     EndPoint local, remote;
+    TCPHeaderTemplate header; // of every segment sent once established
     uint16_t mss;
     uint8_t scale;
     uint32_t frame_send, ack_receive, frame_receive;
+    uint32_t ack_delayed; // segments received since the last segment carrying an ack
     uint32_t local_window, remote_window;
-    Array<uint8_t> buffer;
-    size_t buffer_start, buffer_end;
-    std::mutex lock, sender_lock;
-    std::condition_variable full;
+    ByteRing buffer;    // the application produces, the protocol consumes what is acked
     uint32_t close_seq;
     bool closed;
+    bool sack;
+    TCPSACKBlocks sack_blocks; // blocks to report to the remote
+    TCPSequenceRanges scoreboard; // ranges the remote has reported
+    bool timestamp;
+    uint32_t ts_recent; // timestamp to echo to the remote
+    bool nodelay;       // send small segments even with data in flight
+    bool cork;          // hold back partial segments until uncorked
 
-    size_t index_increase(size_t index, size_t diff) const {
-        return index + diff >= buffer.size() ? index + diff - buffer.size() : index + diff;
-    }
-
-    uint32_t get_size() const {
-        if (buffer_end >= buffer_start) {
-            return buffer_end - buffer_start;
-        } else {
-            return buffer.size() + buffer_end - buffer_start;
-        }
-    }
+    uint32_t get_size() const { return buffer.readable(); }
 
     TCPSender(EndPoint local, EndPoint remote, uint32_t local_seq, uint32_t remote_seq,
-              uint16_t mss, uint8_t scale, uint32_t remote_window) :
-            local{local}, remote{remote}, mss{mss}, scale{scale},
+              uint16_t mss, uint8_t scale, uint32_t local_window, uint32_t remote_window,
+              size_t size, bool sack, bool timestamp, uint32_t ts_recent) :
+            local{local}, remote{remote},
+            header{0, local.ip_addr, remote.ip_addr, 64, local.port, remote.port},
+            mss{mss}, scale{scale},
             frame_send{local_seq}, ack_receive{local_seq}, frame_receive{remote_seq},
-            local_window{BUFFER_SIZE - 1}, remote_window{remote_window},
-            buffer{BUFFER_SIZE}, buffer_start{}, buffer_end{}, close_seq{0}, closed{false} {}
+            ack_delayed{0}, local_window{local_window}, remote_window{remote_window},
+            buffer{size}, close_seq{0}, closed{false},
+            sack{sack}, sack_blocks{}, scoreboard{size / mss + 1},
+            timestamp{timestamp}, ts_recent{ts_recent},
+            nodelay{false}, cork{false} {}
 
     TCPSender(TCPSender &&other) noexcept = delete;
 
@@ -57,35 +313,105 @@ public:
         return closed && frame_send == ack_receive && frame_send == close_seq + 1;
     }
 
-    ssize_t send(Slice<uint8_t> data);
+    ssize_t sendv(Slice<Slice<uint8_t>> data);
+
+    ssize_t send(Slice<uint8_t> data) { return sendv(Slice<Slice<uint8_t>>{&data, 1}); }
+
+    /// `try_sendv` would not return -1
+    bool is_writable() const { return buffer.writable() > 0 || buffer.is_closed(); }
+
+    ssize_t try_sendv(Slice<Slice<uint8_t>> data) {
+        if (buffer.is_closed()) { return 0; }
+        if (buffer.writable() == 0) { return -1; }
+
+        return buffer.writev(data);
+    }
+
+    std::pair<MutSlice<uint8_t>, MutSlice<uint8_t>> reserve(size_t size) {
+        if (!buffer.wait_writable()) { return {}; }
+
+        return buffer.reserve(size);
+    }
+
+    void commit(size_t size) { buffer.commit(size); }
 
     uint32_t ack_update(uint32_t ack);
 
+    void sack_update(const TCPSACKBlocks &blocks);
+
+    /// highest sequence the remote has reported by sack
+    uint32_t sack_high() const {
+        return scoreboard.empty() ? ack_receive : scoreboard.back().end;
+    }
+
+    uint16_t get_identification(uint16_t count = 1) const {
+        return IPV4IdentificationGenerator::get().next(local.ip_addr, remote.ip_addr,
+                                                       IPV4Protocol::TCP, count);
+    }
+
     uint32_t get_send_window() const { return std::max(remote_window, 1u); }
 
     uint16_t get_receive_window() const {
         return std::min<uint32_t>(local_window >> scale, std::numeric_limits<uint16_t>::max());
     }
 
-    void generate_ack(MPSCQueue<PacketBuffer>::Sender &sender) const {
+    TCPSegmentOption get_option(bool with_sack) const {
+        TCPSegmentOption option{};
+
+        if (timestamp) { option.push(TCPOptionTime{tcp_timestamp(), ts_recent}.into_slice()); }
+
+        if (with_sack && sack_blocks.size > 0) {
+            auto sack_option = sack_blocks.into_option();
+            option.push(sack_option.into_slice());
+        }
+
+        return option;
+    }
+
+    /// payload of a full sized data segment
+    uint32_t get_payload() const { return mss - get_option(false).size; }
+
+    /// RFC 896, of the `window` bytes ready to leave with `transmitting` in flight, only send
+    /// the trailing partial segment when nothing is outstanding, unless corked or `nodelay`
+    uint32_t nagle(uint32_t transmitting, uint32_t window) const {
+        if (closed || window <= transmitting || window != get_size()) { return window; }
+        if (!cork && (nodelay || transmitting == 0)) { return window; }
+
+        uint32_t payload = get_payload();
+        return std::max(transmitting, transmitting + (window - transmitting) / payload * payload);
+    }
+
+    void generate_ack(MPSCQueue<PacketBuffer>::Sender &sender) {
         auto send = sender.try_send().unwrap();
         if (send.none()) {
             cs120_warn("package lost!");
             return;
         }
 
-        TCPHeader::generate((*send)[Range{}], 0, IDENTIFIER,
-                            local.ip_addr, remote.ip_addr, 64, local.port, remote.port,
-                            frame_send, frame_receive,
-                            false, false, false, false, true, false, false, false, false,
-                            get_receive_window(), Slice<uint8_t>{}, 0);
+        auto option = get_option(true);
+
+        header.generate((*send)[Range{}], get_identification(), frame_send, frame_receive,
+                        TCPHeader::FLAGS_ACK, get_receive_window(), option.into_slice(), 0);
+
+        ack_delayed = 0;
     }
 
     void generate_data(MPSCQueue<PacketBuffer>::Sender &sender, uint32_t offset, uint32_t window) {
         size_t remain = get_size();
 
+        auto option = get_option(false);
+
+        // the mss excludes the options
+        uint32_t payload = mss - option.size;
+
+        // as many segments as fit in a packet buffer leave as one super segment, which the
+        // device cuts, see `tcp_gso_segment`
+        size_t header_size = sizeof(IPV4Header) + sizeof(TCPHeader) + option.size;
+        uint32_t batch = std::max<size_t>((PACKET_BUFFER_SIZE - header_size) / payload, 1) *
+                         payload;
+
         for (uint32_t size; offset < window; offset += size) {
-            size = std::min<size_t>(mss, window - offset);
+            size = std::min<size_t>(batch, window - offset);
 
             auto send = sender.try_send().unwrap();
             if (send.none()) {
@@ -95,24 +421,21 @@ public:
                 return;
             }
 
-            auto tcp_buffer = TCPHeader::generate((*send)[Range{}], 0, IDENTIFIER,
-                                                  local.ip_addr, remote.ip_addr, 64,
-                                                  local.port, remote.port,
-                                                  ack_receive + offset, frame_receive,
-                                                  false, false, false, false, true,
-                                                  offset + size == remain, false, false, false,
-                                                  get_receive_window(), Slice<uint8_t>{}, size);
-
-            uint32_t end = buffer_end;
-            uint32_t start = index_increase(buffer_start, offset);
-
-            if (buffer_start < end) {
-                tcp_buffer->copy_from_slice(buffer[Range{start}][Range{0, size}]);
-            } else {
-                size_t len = std::min<size_t>(size, buffer.size() - start);
-                (*tcp_buffer)[Range{0, len}].copy_from_slice(buffer[Range{start}][Range{0, len}]);
-                (*tcp_buffer)[Range{len}].copy_from_slice(buffer[Range{0, size - len}]);
-            }
+            uint8_t flags = TCPHeader::FLAGS_ACK;
+            if (offset + size == remain) { flags |= TCPHeader::FLAGS_PUSH; }
+
+            // `tcp_gso_segment` counts the identification up once per segment
+            uint16_t count = (size + payload - 1) / payload;
+
+            auto tcp_buffer = header.generate((*send)[Range{}], get_identification(count),
+                                              ack_receive + offset, frame_receive, flags,
+                                              get_receive_window(), option.into_slice(), size);
+
+            buffer.read_at(offset, *tcp_buffer);
+            send->segment_size = size > payload ? payload : 0;
+
+            // the ack rides on the data
+            ack_delayed = 0;
         }
 
         frame_send = std::max(frame_send, ack_receive + window);
@@ -122,6 +445,24 @@ public:
         }
     }
 
+    /// retransmit the ranges within `[begin, end)` the remote has not reported by sack,
+    /// return where the retransmission stopped
+    uint32_t generate_holes(MPSCQueue<PacketBuffer>::Sender &sender,
+                            uint32_t begin, uint32_t end) {
+        for (auto &range: scoreboard) {
+            if (!tcp_seq_before(range.seq, end)) { break; }
+            if (!tcp_seq_before(begin, range.end)) { continue; }
+
+            if (tcp_seq_before(begin, range.seq)) {
+                generate_data(sender, begin - ack_receive, range.seq - ack_receive);
+            }
+
+            begin = range.end;
+        }
+
+        return begin;
+    }
+
     void generate_fin(MPSCQueue<PacketBuffer>::Sender &sender) {
         auto send = sender.try_send().unwrap();
         if (send.none()) {
@@ -129,11 +470,13 @@ public:
             return;
         }
 
-        TCPHeader::generate((*send)[Range{}], 0, IDENTIFIER,
-                            local.ip_addr, remote.ip_addr, 64, local.port, remote.port,
-                            close_seq, frame_receive,
-                            false, false, false, false, true, false, false, false, true,
-                            get_receive_window(), Slice<uint8_t>{}, 0);
+        auto option = get_option(false);
+
+        header.generate((*send)[Range{}], get_identification(), close_seq, frame_receive,
+                        TCPHeader::FLAGS_ACK | TCPHeader::FLAGS_FIN, get_receive_window(),
+                        option.into_slice(), 0);
+
+        ack_delayed = 0;
 
         frame_send = close_seq + 1;
     }
@@ -143,39 +486,32 @@ public:
 
 class TCPReceiver {
 public:
-    static constexpr size_t BUFFER_SIZE = 1 << 16;
+    static constexpr size_t DEFAULT_BUFFER_SIZE = 1 << 16;
 
     EndPoint local, remote;
     uint16_t mss;
     uint8_t scale;
     uint32_t ack_receive, frame_receive;
-    std::map<uint32_t, uint32_t> fragments; // todo
-    Array<uint8_t> buffer;
-    size_t buffer_start, buffer_end;
-    std::mutex lock, receiver_lock;
-    std::condition_variable empty;
+    TCPSequenceRanges fragments; // out of order data held in the buffer
+    uint32_t last_fragment;      // start of the range holding the latest segment
+    bool sack;
+    bool timestamp;
+    uint32_t ts_recent; // latest timestamp of the remote, echoed back by the sender
+    ByteRing buffer;    // the protocol produces in order data, the application consumes it
     uint32_t close_seq;
     bool closed;
 
-    size_t index_increase(size_t index, size_t diff) const {
-        return index + diff >= buffer.size() ? index + diff - buffer.size() : index + diff;
-    }
-
-    size_t get_window() const {
-        if (buffer_end >= buffer_start) {
-            return buffer.size() + buffer_start - buffer_end - 1;
-        } else {
-            return buffer_start - buffer_end - 1;
-        }
-    }
+    size_t get_window() const { return buffer.writable(); }
 
 public:
     TCPReceiver(EndPoint local, EndPoint remote, uint32_t local_seq, uint32_t remote_seq,
-                uint16_t mss, uint8_t scale) :
+                uint16_t mss, uint8_t scale, size_t size, bool sack, bool timestamp,
+                uint32_t ts_recent) :
             local{local}, remote{remote}, mss{mss}, scale{scale},
             ack_receive{local_seq}, frame_receive{remote_seq},
-            fragments{}, buffer{BUFFER_SIZE}, buffer_start{0}, buffer_end{0},
-            lock{}, receiver_lock{}, empty{}, close_seq{0}, closed{false} {}
+            fragments{size / std::max<uint16_t>(mss, 1) + 1}, last_fragment{remote_seq}, sack{sack},
+            timestamp{timestamp}, ts_recent{ts_recent},
+            buffer{size}, close_seq{0}, closed{false} {}
 
     TCPReceiver(TCPReceiver &&other) noexcept = delete;
 
@@ -185,15 +521,107 @@ public:
 
     void accept(uint32_t seq, Slice<uint8_t> data);
 
+    TCPSACKBlocks get_sack() const;
+
     void close(uint32_t seq);
 
-    ssize_t recv(MutSlice<uint8_t> data);
+    ssize_t recvv(Slice<MutSlice<uint8_t>> data);
 
-    bool has_data() const { return buffer_start != buffer_end; }
+    ssize_t recv(MutSlice<uint8_t> data) { return recvv(Slice<MutSlice<uint8_t>>{&data, 1}); }
+
+    /// `try_recvv` would not return -1
+    bool is_readable() const { return buffer.readable() > 0 || buffer.is_closed(); }
+
+    ssize_t try_recvv(Slice<MutSlice<uint8_t>> data) {
+        // the ring is closed after the last commit, so seeing it closed first means nothing is
+        // still on its way
+        bool eof = buffer.is_closed();
+
+        size_t size = buffer.readv(data);
+        if (size == 0 && !eof) { return -1; }
+
+        return size;
+    }
+
+    std::pair<Slice<uint8_t>, Slice<uint8_t>> peek() {
+        if (!buffer.wait_readable()) { return {}; }
+
+        return buffer.peek();
+    }
+
+    void consume(size_t size) { buffer.consume(size); }
+
+    bool has_data() const { return buffer.readable() > 0; }
 
     ~TCPReceiver() = default;
 };
 
+class TCPConnection;
+
+/// a state machine driven by a `TCPEngine` worker, a connection or a listener
+class TCPTask {
+public:
+    using Clock = std::chrono::steady_clock;
+    using TimePoint = Clock::time_point;
+
+    /// report readiness of the queues of this task to `waker` under `token`
+    virtual void attach(const std::shared_ptr<Waker> &waker, size_t token) = 0;
+
+    /// advance the state machine, return when it wants to be polled again at the latest
+    virtual TimePoint poll(TimePoint current) = 0;
+
+    virtual bool is_finished() const = 0;
+
+    virtual ~TCPTask() = default;
+};
+
+/// reactor threads running the state machines of tcp connections, a connection stays on one
+/// worker, which wakes up on the queues of its connections or on their deadlines
+class TCPEngine {
+public:
+    using Clock = TCPTask::Clock;
+    using TimePoint = TCPTask::TimePoint;
+
+private:
+    struct Worker {
+        pthread_t thread;
+        std::shared_ptr<Waker> waker;
+        std::mutex lock;
+        std::vector<std::shared_ptr<TCPTask>> pending; // not yet seen by the thread
+    };
+
+    struct WorkerArgs {
+        TCPEngine *engine;
+        Worker *worker;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<size_t> next_worker, next_token;
+
+    static void *tcp_worker(void *args);
+
+public:
+    /// `count` reactor threads, started at once and never stopped
+    explicit TCPEngine(size_t count = 1);
+
+    /// the engine shared by connections which do not name one, with a single thread, never
+    /// destroyed as its thread outlives `main`
+    static TCPEngine &get() {
+        static auto *instance = new TCPEngine{};
+        return *instance;
+    }
+
+    TCPEngine(const TCPEngine &other) = delete;
+
+    TCPEngine &operator=(const TCPEngine &other) = delete;
+
+    void add(std::shared_ptr<TCPTask> task);
+
+    ~TCPEngine() = default;
+};
+
+/// the buffers are single producer and single consumer, one thread may send while another
+/// receives, but two threads must not send or receive on the same client at once
 class TCPClient {
 public:
     struct Request {
@@ -201,6 +629,8 @@ public:
             FrameReceive,
             AckReceive,
             FrameSend,
+            Cork,
+            NoDelay,
             Close,
         } type;
         union {
@@ -209,13 +639,27 @@ public:
                 uint32_t remote_window;
                 uint32_t frame_receive;
                 uint32_t local_window;
+                TCPSACKBlocks sack;        // to report to the remote
+                TCPSACKBlocks remote_sack; // the remote has reported on the segment
+                uint32_t ts_recent;
+                uint32_t ts_echo;
+                uint16_t immediate; // acknowledgements to send without delay
             } frame_receive;
             struct {
                 uint32_t ack_receive;
                 uint32_t remote_window;
+                TCPSACKBlocks sack;
+                uint32_t ts_recent;
+                uint32_t ts_echo;
             } ack_receive;
             struct {
             } frame_send;
+            struct {
+                bool value;
+            } cork;
+            struct {
+                bool value;
+            } nodelay;
             struct {
                 uint32_t ack_receive;
                 uint32_t frame_receive;
@@ -226,72 +670,476 @@ public:
     struct SyncOption : public IntoSliceTrait<SyncOption> {
         TCPOptionMSS mss;
         TCPOptionScale scale;
+        TCPOptionSACKPermitted sack;
+        TCPOptionTime time;
 
-        explicit SyncOption(uint16_t mss, uint8_t scale) : mss{mss}, scale{scale} {}
+        explicit SyncOption(uint16_t mss, uint8_t scale) :
+                mss{mss}, scale{scale}, time{tcp_timestamp(), 0} {}
     };
 
 private:
-    struct TCPSendArgs {
-        MPSCQueue<PacketBuffer>::Sender send_queue;
-        MPSCQueue<Request>::Receiver request_receiver;
-        std::shared_ptr<TCPSender> connection;
-    };
-
-    struct TCPRecvArgs {
-        Demultiplexer<PacketBuffer>::ReceiverGuard recv_queue;
-        MPSCQueue<TCPClient::Request>::Sender request_sender;
-        std::shared_ptr<TCPReceiver> connection;
-    };
-
-    static void *tcp_sender(void *args);
-
-    static void *tcp_receiver(void *args);
-
-    pthread_t send_thread, recv_thread;
     std::shared_ptr<BaseSocket> device;
+    std::shared_ptr<TCPConnection> connection;
     std::shared_ptr<TCPSender> sender;
     std::shared_ptr<TCPReceiver> receiver;
     MPSCQueue<TCPClient::Request>::Sender request_sender;
 
+    void notify_send() {
+        auto send = request_sender.send();
+        if (!send.none()) { *send = Request{Request::FrameSend, {.frame_send = {}}}; }
+    }
+
+    void open(std::shared_ptr<BaseSocket> &device, size_t size, EndPoint local, EndPoint remote,
+              size_t send_size, size_t receive_size, TCPCongestionAlgorithm congestion,
+              TCPEngine &engine);
+
+    bool establish(bool block);
+
+    /// whether the buffers are there, waiting for the handshake only when `block`,
+    /// a connection gone before the handshake completes never has them
+    bool ready(bool block) { return sender != nullptr || establish(block); }
+
+    friend class TCPListener;
+
+    /// a connection accepted by a listener, already established
+    TCPClient(std::shared_ptr<BaseSocket> device, std::shared_ptr<TCPConnection> connection,
+              MPSCQueue<TCPClient::Request>::Sender &&requests);
+
 public:
     TCPClient() :
-            send_thread{}, recv_thread{}, device{},
-            sender{nullptr}, receiver{nullptr}, request_sender{} {};
-
-    TCPClient(std::shared_ptr<BaseSocket> &device, size_t size, EndPoint local, EndPoint remote);
+            device{}, connection{nullptr}, sender{nullptr}, receiver{nullptr},
+            request_sender{} {};
+
+    /// `send_size` and `receive_size` are the buffer sizes of this connection, the window scale
+    /// advertised to the remote is derived from `receive_size`, `congestion` selects the
+    /// congestion control of this connection, which runs on `engine`, blocks until the
+    /// handshake completes
+    TCPClient(std::shared_ptr<BaseSocket> &device, size_t size, EndPoint local, EndPoint remote,
+              size_t send_size = TCPSender::DEFAULT_BUFFER_SIZE,
+              size_t receive_size = TCPReceiver::DEFAULT_BUFFER_SIZE,
+              TCPCongestionAlgorithm congestion = TCPCongestionAlgorithm::Reno,
+              TCPEngine &engine = TCPEngine::get());
+
+    /// as the constructor, but returns as soon as the syn is on its way, the handshake is
+    /// followed by `is_connecting` or a waker, and blocking calls wait for it
+    static TCPClient connect(std::shared_ptr<BaseSocket> &device, size_t size,
+                             EndPoint local, EndPoint remote,
+                             size_t send_size = TCPSender::DEFAULT_BUFFER_SIZE,
+                             size_t receive_size = TCPReceiver::DEFAULT_BUFFER_SIZE,
+                             TCPCongestionAlgorithm congestion = TCPCongestionAlgorithm::Reno,
+                             TCPEngine &engine = TCPEngine::get());
 
     TCPClient(TCPClient &&other) noexcept = default;
 
     TCPClient &operator=(TCPClient &&other) noexcept = default;
 
+    /// default constructed or moved from, e.g. nothing to accept
+    bool none() const { return connection == nullptr; }
+
+    bool is_connecting();
+
+    /// `try_recv` would not return -1
+    bool is_readable() { return ready(false) ? receiver->is_readable() : !is_connecting(); }
+
+    /// `try_send` would not return -1
+    bool is_writable() { return ready(false) ? sender->is_writable() : !is_connecting(); }
+
+    /// `waker` is told under `token` when the handshake is over, when data arrives, when room
+    /// frees up in the send buffer and when the connection goes, and once for the current
+    /// state, a wake up is only a hint to try again
+    void set_waker(std::shared_ptr<Waker> waker, size_t token);
+
     ssize_t send(Slice<uint8_t> data) {
+        if (!ready(true)) { return 0; }
+
         auto result = sender->send(data);
+        notify_send();
+        return result;
+    }
 
-        auto send = request_sender.send();
-        if (!send.none()) {
-            *send = TCPClient::Request{TCPClient::Request::FrameSend, {.frame_send = {}}};
-        }
+    /// send the slices in `data` back to back, as much as fits in one go, e.g. a header and
+    /// a body without joining them first
+    ssize_t sendv(Slice<Slice<uint8_t>> data) {
+        if (!ready(true)) { return 0; }
 
+        auto result = sender->sendv(data);
+        notify_send();
         return result;
     }
 
-    ssize_t recv(MutSlice<uint8_t> data) { return receiver->recv(data); }
+    /// as `sendv`, but -1 instead of blocking while connecting or while the buffer is full
+    ssize_t try_sendv(Slice<Slice<uint8_t>> data) {
+        if (!ready(false)) { return is_connecting() ? -1 : 0; }
 
-    bool has_data() { return receiver->has_data(); }
+        auto result = sender->try_sendv(data);
+        if (result > 0) { notify_send(); }
+        return result;
+    }
+
+    ssize_t try_send(Slice<uint8_t> data) { return try_sendv(Slice<Slice<uint8_t>>{&data, 1}); }
+
+    /// room in the send buffer to fill in place, e.g. by `read` from a file, instead of
+    /// copying through `send`, at most `size` bytes over two regions when the buffer wraps,
+    /// blocks until there is room, both are empty once the connection is gone
+    std::pair<MutSlice<uint8_t>, MutSlice<uint8_t>> reserve(size_t size) {
+        if (!ready(true)) { return {}; }
+
+        return sender->reserve(size);
+    }
+
+    /// send the first `size` bytes of what `reserve` returned
+    void commit(size_t size) {
+        sender->commit(size);
+        notify_send();
+    }
+
+    /// hold back partial segments, so that several small writes leave as full segments
+    void cork() {
+        auto send = request_sender.send();
+        if (!send.none()) { *send = Request{Request::Cork, {.cork = {true}}}; }
+    }
+
+    /// send what has been held back by `cork`
+    void uncork() {
+        auto send = request_sender.send();
+        if (!send.none()) { *send = Request{Request::Cork, {.cork = {false}}}; }
+    }
+
+    /// disable the Nagle algorithm, small writes leave at once even with data in flight
+    void set_nodelay(bool value) {
+        auto send = request_sender.send();
+        if (!send.none()) { *send = Request{Request::NoDelay, {.nodelay = {value}}}; }
+    }
+
+    ssize_t recv(MutSlice<uint8_t> data) { return ready(true) ? receiver->recv(data) : 0; }
+
+    /// fill the slices in `data` one after another with what has been received
+    ssize_t recvv(Slice<MutSlice<uint8_t>> data) {
+        return ready(true) ? receiver->recvv(data) : 0;
+    }
+
+    /// as `recvv`, but -1 instead of blocking while connecting or while nothing has arrived,
+    /// 0 once the remote has closed and everything is received
+    ssize_t try_recvv(Slice<MutSlice<uint8_t>> data) {
+        if (!ready(false)) { return is_connecting() ? -1 : 0; }
+
+        return receiver->try_recvv(data);
+    }
+
+    ssize_t try_recv(MutSlice<uint8_t> data) {
+        return try_recvv(Slice<MutSlice<uint8_t>>{&data, 1});
+    }
+
+    /// the received data in place, to be written out or scanned without copying it first,
+    /// over two regions when the buffer wraps, blocks until there is data, both are empty
+    /// once the remote has closed and everything is consumed
+    std::pair<Slice<uint8_t>, Slice<uint8_t>> peek() {
+        if (!ready(true)) { return {}; }
+
+        return receiver->peek();
+    }
+
+    /// release the first `size` bytes of what `peek` returned
+    void consume(size_t size) { receiver->consume(size); }
+
+    bool has_data() { return ready(false) && receiver->has_data(); }
 
     ~TCPClient() {
+        // moved from
+        if (connection == nullptr) { return; }
+
         {
             auto send = request_sender.try_send();
             if (!send.none()) {
                 *send = Request{Request::Close, {.close = {
-                        receiver->ack_receive, receiver->frame_receive
+                        receiver == nullptr ? 0 : receiver->ack_receive,
+                        receiver == nullptr ? 0 : receiver->frame_receive
                 }}};
             }
         }
+    }
+};
+
+/// the state machine of one connection, from the syn to the acknowledgement of the fin,
+/// polled by a `TCPEngine` worker whenever a queue of it is ready or its deadline passes
+class TCPConnection : public TCPTask {
+public:
+    /// a passive open gives up after this many retransmissions of its syn
+    static constexpr size_t PASSIVE_SYNC_RETRIES = 5;
+
+    enum class State {
+        Closed,
+        SyncSent,
+        SyncReceived,
+        Established,
+        Finished,
+    };
+
+private:
+    using Request = TCPClient::Request;
+
+    EndPoint local, remote;
+    uint16_t mtu;
+    size_t send_size, receive_size;
+    TCPCongestionAlgorithm algorithm;
+
+    MPSCQueue<PacketBuffer>::Sender send_queue;
+    Demultiplexer<PacketBuffer>::ReceiverGuard recv_queue;
+    MPSCQueue<Request>::Receiver request_receiver;
+
+    std::mutex lock;
+    std::condition_variable established;
+    std::atomic<State> state;
+    std::shared_ptr<Waker> waker; // of the application, guarded by `lock`
+    size_t token;
 
-//        pthread_join(send_thread, nullptr);
-//        pthread_join(recv_thread, nullptr);
+    std::shared_ptr<TCPSender> sender;
+    std::shared_ptr<TCPReceiver> receiver;
+
+    TCPRetransmissionTimer timer;
+
+    // handshake
+    uint16_t local_mss, remote_mss;
+    uint8_t local_scale, remote_scale;
+    bool scale, sack, timestamp;
+    uint32_t ts_recent;
+    uint32_t local_seq, remote_seq;
+    uint32_t local_window, remote_window;
+    TCPClient::SyncOption option;
+    bool sync, ack, retransmitted;
+    bool passive;
+    size_t sync_retries;
+    TimePoint sync_start, sync_deadline;
+
+    // transfer
+    std::unique_ptr<TCPCongestionControl> congestion;
+    uint32_t transmitting;
+
+    // RFC 6582 fast recovery state, `recover` is the highest sequence sent on entering it
+    uint32_t last_ack_count;
+    uint32_t recover;
+    bool recovery;
+    uint32_t inflation; // added to the congestion window during recovery
+
+    // with pacing, new data may not leave before `pace_next`
+    TimePoint pace_next;
+    bool paced;
+
+    TimePoint ack_deadline;
+
+    // with sack, sequence below which the holes have been retransmitted in this recovery
+    uint32_t retransmit_next;
+
+    // without timestamps one segment is timed at a time, never a retransmitted one (Karn)
+    bool timing;
+    uint32_t timing_seq;
+    TimePoint timing_start;
+
+    std::list<std::pair<TimePoint, uint32_t>> timeout;
+
+    // RFC 1323 header prediction, data offset, flags but push and window of the segment
+    // expected next, as they are in memory
+    uint8_t prediction[4];
+
+    void generate_sync();
+
+    void handshake(Slice<uint8_t> datagram, TimePoint current);
+
+    /// both syns are acknowledged, set up the buffers and wake who waits for them
+    void establish();
+
+    /// `segment_size` is nonzero for segments merged by the device, see `PacketBuffer`
+    void receive(Slice<uint8_t> datagram, uint16_t segment_size, TimePoint current);
+
+    /// the fast path of `receive` for the in order data or pure ack of a bulk transfer, false
+    /// if the segment needs the slow one
+    bool receive_predicted(const TCPHeader &tcp_header, Slice<uint8_t> tcp_option,
+                           Slice<uint8_t> tcp_data, uint16_t segment_size, TimePoint current);
+
+    void handle(const Request &request, TimePoint current);
+
+    void retransmit(TimePoint current);
+
+    void transmit(TimePoint current);
+
+    void finish();
+
+public:
+    TCPConnection(std::shared_ptr<BaseSocket> &device, size_t size, EndPoint local,
+                  EndPoint remote, size_t send_size, size_t receive_size,
+                  TCPCongestionAlgorithm algorithm, MPSCQueue<Request>::Receiver &&requests);
+
+    TCPConnection(TCPConnection &&other) noexcept = delete;
+
+    TCPConnection &operator=(TCPConnection &&other) noexcept = delete;
+
+    void attach(const std::shared_ptr<Waker> &waker, size_t token) override {
+        recv_queue->set_waker(waker, token);
+        request_receiver.set_waker(waker, token);
     }
+
+    TimePoint poll(TimePoint current) override;
+
+    bool is_finished() const override { return state == State::Finished; }
+
+    bool is_connecting() const {
+        return state == State::Closed || state == State::SyncSent || state == State::SyncReceived;
+    }
+
+    /// passive open, answer the syn in `datagram` with a syn of our own, before the connection
+    /// is handed to an engine
+    void accept_sync(Slice<uint8_t> datagram, TimePoint current);
+
+    /// passive open completed by the ack in `datagram` of a syn ack with the isn `cookie`
+    /// stands for, before the connection is handed to an engine
+    void accept_cookie(Slice<uint8_t> datagram, uint16_t segment_size, TimePoint current,
+                       TCPSyncCookie::Option cookie);
+
+    /// `waker` is told under `token` when the handshake completes, when the connection
+    /// finishes, and by the buffers from then on
+    void set_waker(std::shared_ptr<Waker> value, size_t value_token);
+
+    /// block until the handshake completes
+    std::pair<std::shared_ptr<TCPSender>, std::shared_ptr<TCPReceiver>> wait_established();
+
+    ~TCPConnection() = default;
+};
+
+/// the passive side of a `TCPListener`, answers syns to its port from any remote with a
+/// connection of their own, and queues those connections once their handshake completes
+///
+/// while `sync_backlog` handshakes are going on, a syn is answered statelessly with a syn
+/// cookie instead, and the connection is only created by the ack of it, while
+/// `accept_backlog` connections wait to be accepted, a syn is dropped for the remote to try again
+///
+/// a handshake completing with `accept_backlog` connections already waiting leaves its
+/// connection where it is until one of them is accepted, the queue never grows past the bound
+class TCPAcceptor : public TCPTask {
+public:
+    struct Entry {
+        std::shared_ptr<TCPConnection> connection;
+        MPSCQueue<TCPClient::Request>::Sender requests;
+    };
+
+private:
+    std::shared_ptr<BaseSocket> device;
+    size_t size;
+    EndPoint local;
+    size_t sync_backlog, accept_backlog;
+    size_t send_size, receive_size;
+    TCPCongestionAlgorithm algorithm;
+    TCPEngine &engine;
+
+    // shared with the filter, which only lets acks through while cookies may be out
+    std::shared_ptr<const TCPSyncCookie> cookie;
+    std::shared_ptr<std::atomic<TimePoint>> cookie_sent;
+
+    MPSCQueue<PacketBuffer>::Sender send_queue;
+    Demultiplexer<PacketBuffer>::ReceiverGuard recv_queue;
+
+    // of the worker, children report to it when their handshake is over
+    std::shared_ptr<Waker> worker_waker;
+    size_t worker_token;
+
+    std::list<Entry> syncing;
+    size_t held; // of `syncing`, established but kept out of a full `accepted`
+    std::unordered_map<uint64_t, std::weak_ptr<TCPConnection>> remotes; // every child alive
+    size_t sweep_size;
+
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<Entry> accepted;
+    std::atomic<bool> closed;
+    std::atomic<bool> finished;
+    std::shared_ptr<Waker> waker; // of the application, guarded by `lock`
+    size_t token;
+
+    /// a syn, or the ack of a syn cookie, from a remote without a connection yet
+    void accept(Slice<uint8_t> datagram, uint16_t segment_size, TimePoint current);
+
+    void send_cookie(EndPoint remote, const TCPHeader &tcp_header, Slice<uint8_t> tcp_option,
+                     TimePoint current);
+
+    void finish();
+
+public:
+    TCPAcceptor(std::shared_ptr<BaseSocket> &device, size_t size, EndPoint local,
+                size_t sync_backlog, size_t accept_backlog, size_t send_size,
+                size_t receive_size, TCPCongestionAlgorithm algorithm, TCPEngine &engine);
+
+    TCPAcceptor(TCPAcceptor &&other) noexcept = delete;
+
+    TCPAcceptor &operator=(TCPAcceptor &&other) noexcept = delete;
+
+    void attach(const std::shared_ptr<Waker> &value, size_t value_token) override;
+
+    TimePoint poll(TimePoint current) override;
+
+    bool is_finished() const override { return finished; }
+
+    /// the next connection out of the accept queue, blocking for one only when `block`,
+    /// false if there is none
+    bool pop(Entry &entry, bool block);
+
+    bool has_accepted() {
+        std::unique_lock<std::mutex> guard{lock};
+        return !accepted.empty() || finished;
+    }
+
+    void set_waker(std::shared_ptr<Waker> value, size_t value_token);
+
+    /// stop answering syns, the connections not accepted yet are closed
+    void close();
+
+    ~TCPAcceptor() = default;
+};
+
+/// a listening port, completing handshakes with any number of remotes in the background
+class TCPListener {
+public:
+    static constexpr size_t DEFAULT_BACKLOG = 128;
+
+private:
+    std::shared_ptr<BaseSocket> device;
+    std::shared_ptr<TCPAcceptor> acceptor;
+
+    TCPClient into_client(TCPAcceptor::Entry &&entry);
+
+public:
+    TCPListener() : device{}, acceptor{nullptr} {}
+
+    /// `sync_backlog` handshakes at most at a time and `accept_backlog` connections waiting
+    /// for `accept` at most, the rest is as for a `TCPClient` and holds for every connection
+    TCPListener(std::shared_ptr<BaseSocket> &device, size_t size, EndPoint local,
+                size_t sync_backlog = DEFAULT_BACKLOG, size_t accept_backlog = DEFAULT_BACKLOG,
+                size_t send_size = TCPSender::DEFAULT_BUFFER_SIZE,
+                size_t receive_size = TCPReceiver::DEFAULT_BUFFER_SIZE,
+                TCPCongestionAlgorithm congestion = TCPCongestionAlgorithm::Reno,
+                TCPEngine &engine = TCPEngine::get());
+
+    TCPListener(TCPListener &&other) noexcept = default;
+
+    TCPListener &operator=(TCPListener &&other) noexcept = default;
+
+    /// block until a connection completes its handshake, an empty client once the device is
+    /// gone
+    TCPClient accept();
+
+    /// as `accept`, but an empty client at once when no connection is ready
+    TCPClient try_accept();
+
+    /// `try_accept` has something to return
+    bool is_readable() { return acceptor->has_accepted(); }
+
+    bool is_writable() const { return false; }
+
+    /// `waker` is told under `token` whenever a connection is ready to be accepted, and once
+    /// for the current state
+    void set_waker(std::shared_ptr<Waker> waker, size_t token) {
+        acceptor->set_waker(std::move(waker), token);
+    }
+
+    ~TCPListener() { if (acceptor != nullptr) { acceptor->close(); }}
 };
 }
 
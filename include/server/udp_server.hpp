@@ -3,6 +3,8 @@
 
 
 #include "device/base_socket.hpp"
+#include "wire/udp.hpp"
+#include "ipv4_server.hpp"
 
 
 namespace cs120 {
@@ -13,9 +15,17 @@ private:
     Demultiplexer<PacketBuffer>::ReceiverGuard recv_queue;
     uint32_t src_ip, dest_ip;
     uint16_t src_port, dest_port;
+    UDPHeaderTemplate header;
     Array<uint8_t> receive_buffer;
     MutSlice<uint8_t> receive_buffer_slice;
-    uint16_t identifier;
+
+    /// fill one datagram of `size` bytes with `data` from slice `index` at `offset` onwards
+    void generate(MutSlice<uint8_t> frame, Slice<Slice<uint8_t>> data, size_t size,
+                  size_t &index, size_t &offset);
+
+    ssize_t transmit(Slice<Slice<uint8_t>> data, bool block);
+
+    ssize_t receive(Slice<MutSlice<uint8_t>> data, bool block);
 
 public:
     UDPServer(std::shared_ptr<BaseSocket> &device,  size_t size,
@@ -25,9 +35,40 @@ public:
 
     UDPServer &operator=(UDPServer &&other) noexcept = default;
 
-    size_t send(Slice<uint8_t> data);
+    /// datagrams of at most the device mtu, gathered from the slices in `data` one after another
+    size_t sendv(Slice<Slice<uint8_t>> data) { return transmit(data, true); }
+
+    size_t send(Slice<uint8_t> data) { return sendv(Slice<Slice<uint8_t>>{&data, 1}); }
+
+    /// as `sendv`, but only the datagrams the device queue takes now, -1 if it takes none
+    ssize_t try_sendv(Slice<Slice<uint8_t>> data) { return transmit(data, false); }
+
+    ssize_t try_send(Slice<uint8_t> data) { return try_sendv(Slice<Slice<uint8_t>>{&data, 1}); }
+
+    /// one datagram scattered over the slices in `data`, the rest of it comes with the next call
+    size_t recvv(Slice<MutSlice<uint8_t>> data) { return receive(data, true); }
+
+    size_t recv(MutSlice<uint8_t> data) { return recvv(Slice<MutSlice<uint8_t>>{&data, 1}); }
+
+    /// as `recvv`, but -1 instead of blocking when no datagram has arrived
+    ssize_t try_recvv(Slice<MutSlice<uint8_t>> data) { return receive(data, false); }
+
+    ssize_t try_recv(MutSlice<uint8_t> data) {
+        return try_recvv(Slice<MutSlice<uint8_t>>{&data, 1});
+    }
+
+    /// `try_recv` would not return -1
+    bool is_readable() {
+        return !receive_buffer_slice.empty() || !recv_queue->is_empty() || recv_queue->is_closed();
+    }
+
+    /// the device queue tells no one when it has room again, so sending always counts as ready
+    bool is_writable() const { return true; }
 
-    size_t recv(MutSlice<uint8_t> data);
+    /// `waker` is told under `token` whenever a datagram arrives, and once for those already here
+    void set_waker(std::shared_ptr<Waker> waker, size_t token) {
+        recv_queue->set_waker(std::move(waker), token);
+    }
 
     ~UDPServer() = default;
 };
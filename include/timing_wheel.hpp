@@ -0,0 +1,191 @@
+#ifndef CS120_TIMING_WHEEL_HPP
+#define CS120_TIMING_WHEEL_HPP
+
+
+#include <cstdint>
+#include <array>
+#include <list>
+#include <unordered_map>
+#include <chrono>
+#include <algorithm>
+
+#include "utility.hpp"
+
+
+namespace cs120 {
+/// hierarchical timing wheel of `LEVELS` wheels with `2 ^ BITS` slots each, the slots of a
+/// level span a whole turn of the level below, deadlines further than all levels wait on the
+/// last slot and are placed again when it turns over
+///
+/// `schedule`, `cancel` and firing are O(1), each timer is moved at most `LEVELS - 1` times,
+/// one key holds at most one timer, the wheel is not thread safe
+template<typename Key, size_t LEVELS = 4, size_t BITS = 6>
+class TimingWheel {
+public:
+    using Clock = std::chrono::steady_clock;
+    using TimePoint = Clock::time_point;
+    using Duration = std::chrono::milliseconds;
+
+private:
+    static constexpr size_t SLOTS = 1u << BITS;
+    static constexpr uint64_t MASK = SLOTS - 1;
+    static constexpr uint64_t SPAN = uint64_t{1} << (BITS * LEVELS);
+
+    struct Entry {
+        uint64_t deadline;
+        size_t level, slot;
+        typename std::list<Key>::iterator position;
+    };
+
+    TimePoint origin;
+    uint64_t current; // the first tick not yet fired
+    std::array<std::array<std::list<Key>, SLOTS>, LEVELS> wheels;
+    std::array<size_t, LEVELS> counts;
+    std::unordered_map<Key, Entry> entries;
+
+    /// deadlines round up and the time to advance to rounds down, a timer never fires early
+    template<bool UP>
+    uint64_t get_tick(TimePoint time) const {
+        if (time <= origin) { return 0; }
+
+        auto count = UP ? std::chrono::ceil<Duration>(time - origin).count() :
+                     std::chrono::floor<Duration>(time - origin).count();
+        return static_cast<uint64_t>(count);
+    }
+
+    void place(const Key &key, Entry &entry) {
+        uint64_t tick = std::max(entry.deadline, current);
+        if (tick - current >= SPAN) { tick = current + SPAN - 1; }
+
+        size_t level = 0;
+        while (level + 1 < LEVELS && tick - current >= uint64_t{1} << (BITS * (level + 1))) {
+            ++level;
+        }
+
+        entry.level = level;
+        entry.slot = (tick >> (BITS * level)) & MASK;
+
+        auto &slot = wheels[level][entry.slot];
+        entry.position = slot.insert(slot.end(), key);
+        ++counts[level];
+    }
+
+    /// moves the timers of the slot at `level` that comes due now to the levels below
+    bool cascade(size_t level) {
+        size_t index = (current >> (BITS * level)) & MASK;
+
+        std::list<Key> moving{};
+        moving.swap(wheels[level][index]);
+        counts[level] -= moving.size();
+
+        for (auto &key: moving) { place(key, entries.find(key)->second); }
+
+        return index == 0;
+    }
+
+public:
+    TimingWheel() : origin{Clock::now()}, current{0}, wheels{}, counts{}, entries{} {}
+
+    TimingWheel(const TimingWheel &other) = delete;
+
+    TimingWheel &operator=(const TimingWheel &other) = delete;
+
+    bool empty() const { return entries.empty(); }
+
+    size_t size() const { return entries.size(); }
+
+    bool contains(const Key &key) const { return entries.find(key) != entries.end(); }
+
+    /// sets the timer of `key` to `time`, replacing the one it already has
+    void schedule(const Key &key, TimePoint time) {
+        cancel(key);
+
+        auto &entry = entries.emplace(key, Entry{get_tick<true>(time), 0, 0, {}}).first->second;
+        place(key, entry);
+    }
+
+    bool cancel(const Key &key) {
+        auto ptr = entries.find(key);
+        if (ptr == entries.end()) { return false; }
+
+        wheels[ptr->second.level][ptr->second.slot].erase(ptr->second.position);
+        --counts[ptr->second.level];
+        entries.erase(ptr);
+
+        return true;
+    }
+
+    /// the time to wake up for the next timer, `TimePoint::max()` if there is none
+    ///
+    /// only the first busy slot of each level is looked into, and the current one above the
+    /// lowest level, a timer of a higher level may be earlier than the ones below it
+    TimePoint next_deadline() const {
+        if (entries.empty()) { return TimePoint::max(); }
+
+        uint64_t result = UINT64_MAX;
+
+        for (size_t level = 0; level < LEVELS; ++level) {
+            size_t index = (current >> (BITS * level)) & MASK;
+
+            // above the lowest level, the current slot holds the timers not cascaded yet since
+            // `current` moved into it, as well as ones a whole turn ahead
+            for (size_t i = 0; i < SLOTS; ++i) {
+                auto &slot = wheels[level][(index + i) & MASK];
+                if (slot.empty()) { continue; }
+
+                for (auto &key: slot) {
+                    result = std::min(result, entries.find(key)->second.deadline);
+                }
+
+                if (level == 0 || i > 0) { break; }
+            }
+        }
+
+        return origin + Duration{std::max(result, current)};
+    }
+
+    /// fires every timer due by `time` in deadline order of their slots, `func(key)` is called
+    /// after the timer is removed and may schedule it again
+    template<typename F>
+    void advance(TimePoint time, F &&func) {
+        uint64_t target = get_tick<false>(time);
+
+        while (current <= target) {
+            size_t idle = 0;
+            while (idle < LEVELS && counts[idle] == 0) { ++idle; }
+
+            if (idle == LEVELS) {
+                current = target + 1;
+                break;
+            }
+
+            // no slot turns over before the next turn of the lowest busy level
+            uint64_t step = uint64_t{1} << (BITS * idle);
+            if (idle > 0 && (current & (step - 1)) != 0) {
+                current = std::min((current | (step - 1)) + 1, target + 1);
+                continue;
+            }
+
+            if ((current & MASK) == 0) {
+                for (size_t level = 1; level < LEVELS && cascade(level); ++level) {}
+            }
+
+            std::list<Key> firing{};
+            firing.swap(wheels[0][current & MASK]);
+            counts[0] -= firing.size();
+
+            ++current;
+
+            for (auto &key: firing) {
+                entries.erase(key);
+                func(key);
+            }
+        }
+    }
+
+    ~TimingWheel() = default;
+};
+}
+
+
+#endif //CS120_TIMING_WHEEL_HPP
@@ -133,7 +133,8 @@ class Slice;
 template<typename T>
 class MutSlice;
 
-template<typename U, typename T, bool = std::is_pod<T>::value>
+template<typename U, typename T,
+        bool = std::is_trivial<T>::value && std::is_standard_layout<T>::value>
 struct _clone;
 
 template<typename U, typename T>
@@ -162,7 +163,8 @@ struct _clone<U, T, false> {
     }
 };
 
-template<typename U, typename T, bool = std::is_pod<T>::value>
+template<typename U, typename T,
+        bool = std::is_trivial<T>::value && std::is_standard_layout<T>::value>
 struct _copy;
 
 template<typename U, typename T>
@@ -179,7 +181,7 @@ struct _copy<U, T, false> {
     }
 };
 
-template<typename T, bool = std::is_pod<T>::value>
+template<typename T, bool = std::is_trivial<T>::value && std::is_standard_layout<T>::value>
 struct clear;
 
 template<typename T>
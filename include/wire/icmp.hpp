@@ -23,7 +23,7 @@ private:
     uint16_t checksum;
 
 public:
-    static size_t max_payload(size_t mtu) {
+    static constexpr size_t max_payload(size_t mtu) {
         return IPV4Header::max_payload(mtu) - sizeof(ICMPHeader);
     }
 
@@ -45,7 +45,7 @@ private:
     uint32_t dest_ip;
 
 public:
-    static size_t max_payload(size_t mtu) { return (mtu - sizeof(IPV4Header)) / 8 * 8; }
+    static constexpr size_t max_payload(size_t mtu) { return (mtu - sizeof(IPV4Header)) / 8 * 8; }
 
     IPV4Header(uint8_t type_of_service, uint16_t identification, IPV4Protocol protocol,
                uint32_t src_ip, uint32_t dest_ip,
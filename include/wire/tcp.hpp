@@ -23,13 +23,20 @@ enum class TCPOption : uint8_t {
 
 
 struct TCPOptionMSS {
+    /// RFC 879, assumed when the remote does not say
+    static constexpr uint16_t DEFAULT = 536;
+
     TCPOption op = TCPOption::MaximumSegmentSize;
     uint8_t size = sizeof(TCPOptionMSS) - offsetof(TCPOptionMSS, op);
     uint16_t mss;
 
     explicit TCPOptionMSS(uint16_t mss) : mss{htons(mss)} {}
 
-    uint16_t get_mss() const { return ntohl(mss); }
+    uint16_t get_mss() const { return ntohs(mss); }
+
+    Slice<uint8_t> into_slice() const {
+        return Slice<uint8_t>{reinterpret_cast<const uint8_t *>(this), sizeof(TCPOptionMSS)};
+    }
 }__attribute__((packed));
 
 struct TCPOptionTime {
@@ -40,17 +47,72 @@ struct TCPOptionTime {
     uint32_t time_reply;
 
     TCPOptionTime(uint32_t time_value, uint32_t time_reply) :
-            time_value{time_value}, time_reply{time_reply} {}
+            time_value{htonl(time_value)}, time_reply{htonl(time_reply)} {}
+
+    uint32_t get_time_value() const { return ntohl(time_value); }
+
+    uint32_t get_time_reply() const { return ntohl(time_reply); }
+
+    Slice<uint8_t> into_slice() const {
+        return Slice<uint8_t>{reinterpret_cast<const uint8_t *>(this), sizeof(TCPOptionTime)};
+    }
 }__attribute__((packed));
 
 
 struct TCPOptionScale {
+    static constexpr uint8_t MAX_SCALE = 14; // RFC 7323
+
     TCPOption _pad[1] = {TCPOption::NoOperation};
     TCPOption op = TCPOption::WindowScaleFactor;
     uint8_t scale_size = sizeof(TCPOptionScale) - offsetof(TCPOptionScale, op);
     uint8_t scale;
 
     explicit TCPOptionScale(uint8_t scale) : scale{scale} {}
+
+    Slice<uint8_t> into_slice() const {
+        return Slice<uint8_t>{reinterpret_cast<const uint8_t *>(this), sizeof(TCPOptionScale)};
+    }
+}__attribute__((packed));
+
+
+struct TCPOptionSACKPermitted {
+    TCPOption _pad[2] = {TCPOption::NoOperation, TCPOption::NoOperation};
+    TCPOption op = TCPOption::SACKPermitted;
+    uint8_t size = sizeof(TCPOptionSACKPermitted) - offsetof(TCPOptionSACKPermitted, op);
+
+    Slice<uint8_t> into_slice() const {
+        return Slice<uint8_t>{reinterpret_cast<const uint8_t *>(this),
+                              sizeof(TCPOptionSACKPermitted)};
+    }
+}__attribute__((packed));
+
+
+/// RFC 2018, at most 3 blocks so that a timestamp option still fits in the header
+struct TCPOptionSACK {
+    static constexpr size_t MAX_BLOCKS = 3;
+
+    TCPOption _pad[2] = {TCPOption::NoOperation, TCPOption::NoOperation};
+    TCPOption op = TCPOption::SACK;
+    uint8_t size = 2;
+    uint32_t blocks[MAX_BLOCKS][2] = {};
+
+    size_t get_count() const { return (size - 2) / sizeof(blocks[0]); }
+
+    bool push(uint32_t begin, uint32_t end) {
+        size_t count = get_count();
+        if (count >= MAX_BLOCKS) { return false; }
+
+        blocks[count][0] = htonl(begin);
+        blocks[count][1] = htonl(end);
+        size += sizeof(blocks[0]);
+
+        return true;
+    }
+
+    Slice<uint8_t> into_slice() const {
+        return Slice<uint8_t>{reinterpret_cast<const uint8_t *>(this),
+                              offsetof(TCPOptionSACK, op) + size};
+    }
 }__attribute__((packed));
 
 
@@ -70,11 +132,16 @@ public:
         }
 
         TCPOption option{buffer[index]};
-        while (option == TCPOption::NoOperation) { option = TCPOption{buffer[++index]}; }
+        while (option == TCPOption::NoOperation) {
+            if (++index + 1 >= buffer.size()) {
+                return std::make_pair(TCPOption::End, Slice<uint8_t>{});
+            }
+            option = TCPOption{buffer[index]};
+        }
 
         size_t size = buffer[index + 1];
 
-        if (index + size > buffer.size()) {
+        if (size < 2 || index + size > buffer.size()) {
             return std::make_pair(TCPOption::End, Slice<uint8_t>{});
         } else {
             auto result = std::make_pair(option, buffer[Range{index}][Range{2, size}]);
@@ -116,7 +183,9 @@ public:
     static constexpr uint8_t FLAGS_SYNC = 0x02;
     static constexpr uint8_t FLAGS_FIN = 0x01;
 
-    static size_t max_payload(size_t mtu) {
+    static constexpr size_t CHECKSUM_OFFSET = 16;
+
+    static constexpr size_t max_payload(size_t mtu) {
         return IPV4Header::max_payload(mtu) - sizeof(TCPHeader);
     }
 
@@ -137,15 +206,15 @@ public:
 
     class Guard {
     private:
-        const IPV4Header *ip_header;
         MutSlice<uint8_t> frame;
         MutSlice<uint8_t> inner;
+        uint32_t sum; // of the pseudo header, the header and the options
 
     public:
-        Guard() noexcept: ip_header{nullptr}, frame{}, inner{} {}
+        Guard() noexcept: frame{}, inner{}, sum{0} {}
 
-        Guard(const IPV4Header *ip_header, MutSlice<uint8_t> icmp_frame, MutSlice<uint8_t> inner) :
-                ip_header{ip_header}, frame{icmp_frame} , inner{inner} {}
+        Guard(MutSlice<uint8_t> tcp_frame, MutSlice<uint8_t> inner, uint32_t sum) :
+                frame{tcp_frame}, inner{inner}, sum{sum} {}
 
         Guard(Guard &&other) noexcept = default;
 
@@ -156,8 +225,12 @@ public:
         MutSlice<uint8_t> *operator->() { return &inner; }
 
         ~Guard() {
+            if (frame.empty()) { return; }
+
+            // only the payload is left to add
             auto *tcp_header = reinterpret_cast<TCPHeader *>(frame.begin());
-            tcp_header->set_checksum(complement_checksum(*ip_header, frame));
+            tcp_header->set_checksum(
+                    complement_checksum_complement(sum + complement_checksum_sum(inner)));
         }
     };
 
@@ -186,10 +259,12 @@ public:
 
         tcp_frame[Range{sizeof(TCPHeader)}][Range{0, option.size()}].copy_from_slice(option);
 
-        return Guard{
-                reinterpret_cast<IPV4Header *>(frame.begin()),
-                tcp_frame, tcp_frame[Range{sizeof(TCPHeader) + option.size()}]
-        };
+        IPV4PseudoHeader pseudo{*reinterpret_cast<IPV4Header *>(frame.begin())};
+        uint32_t sum = complement_checksum_sum(pseudo.into_slice()) +
+                       complement_checksum_sum(tcp_frame[Range{0, CHECKSUM_OFFSET}]) +
+                       complement_checksum_sum(option);
+
+        return Guard{tcp_frame, tcp_frame[Range{sizeof(TCPHeader) + option.size()}], sum};
     }
 
     static const TCPHeader *from_slice(Slice<uint8_t> data) {
@@ -272,6 +347,9 @@ public:
         flags = value;
     }
 
+    /// `FLAGS_*` or'ed together
+    void set_flags(uint8_t value) { flags = value; }
+
     uint16_t get_window() const { return ntohs(window); }
 
     void set_window(uint16_t value) { window = htons(value); }
@@ -307,6 +385,76 @@ public:
 }__attribute__((packed));
 
 
+/// the ip and tcp headers of one flow, built once, a segment of the flow copies them, patches the
+/// fields that vary per segment and finishes both checksums from sums taken here
+class TCPHeaderTemplate {
+private:
+    uint8_t header[sizeof(IPV4Header) + sizeof(TCPHeader)];
+    uint32_t ip_sum;  // of the ip header without the total length and identification
+    uint32_t tcp_sum; // of the pseudo header without the length, and the ports
+
+public:
+    TCPHeaderTemplate(uint8_t type_of_service, uint32_t src_ip, uint32_t dest_ip,
+                      uint8_t time_to_live, uint16_t src_port, uint16_t dest_port) : header{} {
+        auto *ip_header = new(header)IPV4Header{type_of_service, 0, IPV4Protocol::TCP,
+                                                src_ip, dest_ip, 0, true, false, time_to_live, 0};
+        ip_header->set_total_length(0);
+
+        auto *tcp_header = new(header + sizeof(IPV4Header))TCPHeader{
+                src_port, dest_port, 0, 0, sizeof(TCPHeader),
+                false, false, false, false, false, false, false, false, false, 0
+        };
+
+        IPV4PseudoHeader pseudo{src_ip, dest_ip, IPV4Protocol::TCP, 0};
+        ip_sum = complement_checksum_sum(ip_header->into_slice());
+        tcp_sum = complement_checksum_sum(pseudo.into_slice()) +
+                  complement_checksum_sum(Slice<uint8_t>{
+                          reinterpret_cast<const uint8_t *>(tcp_header), 4});
+    }
+
+    /// as `TCPHeader::generate` for a segment of the flow, `flags` are `TCPHeader::FLAGS_*`
+    TCPHeader::Guard generate(MutSlice<uint8_t> frame, uint16_t identification,
+                              uint32_t sequence, uint32_t ack_number, uint8_t flags,
+                              uint16_t window, Slice<uint8_t> option, size_t len) const {
+        size_t tcp_size = sizeof(TCPHeader) + option.size() + len;
+        if (frame.size() < sizeof(IPV4Header) + tcp_size) { return {}; }
+
+        frame[Range{0, sizeof(header)}].copy_from_slice(Slice<uint8_t>{header, sizeof(header)});
+
+        auto *ip_header = reinterpret_cast<IPV4Header *>(frame.begin());
+        ip_header->set_total_length(sizeof(IPV4Header) + tcp_size);
+        ip_header->set_identification(identification);
+        ip_header->set_checksum(complement_checksum_complement(
+                ip_sum + complement_checksum_sum(frame[Range{2, 6}])));
+
+        auto tcp_frame = frame[Range{sizeof(IPV4Header)}][Range{0, tcp_size}];
+
+        auto *tcp_header = reinterpret_cast<TCPHeader *>(tcp_frame.begin());
+        tcp_header->set_sequence(sequence);
+        tcp_header->set_ack_number(ack_number);
+        tcp_header->set_header_length(sizeof(TCPHeader) + option.size());
+        tcp_header->set_flags(flags);
+        tcp_header->set_window(window);
+
+        tcp_frame[Range{sizeof(TCPHeader)}][Range{0, option.size()}].copy_from_slice(option);
+
+        // the length of the pseudo header, and what is new from the sequence to the options
+        uint32_t sum = tcp_sum + htons(tcp_size) +
+                       complement_checksum_sum(tcp_frame[Range{4, TCPHeader::CHECKSUM_OFFSET}]) +
+                       complement_checksum_sum(option);
+
+        return TCPHeader::Guard{tcp_frame, tcp_frame[Range{sizeof(TCPHeader) + option.size()}],
+                                sum};
+    }
+};
+
+
+/// RFC 793 modular comparison of sequence numbers
+cs120_static_inline bool tcp_seq_before(uint32_t a, uint32_t b) {
+    return static_cast<int32_t>(a - b) < 0;
+}
+
+
 cs120_static_inline std::tuple<TCPHeader *, MutSlice<uint8_t>, MutSlice<uint8_t>>
 tcp_split(MutSlice<uint8_t> datagram) {
     auto *header = datagram.buffer_cast<TCPHeader>();
@@ -329,6 +477,267 @@ tcp_split(Slice<uint8_t> datagram) {
     auto data = datagram[Range{header->get_header_length()}];
     return std::make_tuple(header, option, data);
 }
+
+
+/// generic segmentation offload, a super segment carries the payload of several segments behind
+/// one header, the payload size of each travels beside it, never in it, see `PacketBuffer`
+///
+/// cut `datagram` in `frame` into segments of `segment_size` one after the other, passing each
+/// to `func`, which returns false to stop, the headers are copied once and only the fields which
+/// differ are patched, identification and sequence number count up, push and fin stay on the
+/// last segment only, return false if `datagram` is no super segment
+template<typename F>
+bool tcp_gso_segment(Slice<uint8_t> datagram, size_t segment_size, MutSlice<uint8_t> frame,
+                     F &&func) {
+    if (segment_size == 0) { return false; }
+
+    auto[ip_header, ip_option, ip_data] = ipv4_split(datagram);
+    if (ip_header == nullptr || ip_header->get_protocol() != IPV4Protocol::TCP) { return false; }
+
+    auto[tcp_header, tcp_option, tcp_data] = tcp_split(ip_data);
+    if (tcp_header == nullptr || tcp_header->get_urgent()) { return false; }
+
+    size_t ip_size = ip_header->get_header_length();
+    size_t header_size = ip_size + tcp_header->get_header_length();
+
+    if (frame.size() < header_size + std::min(segment_size, tcp_data.size())) {
+        cs120_warn("package truncated!");
+        return true;
+    }
+
+    frame[Range{0, header_size}].copy_from_slice(datagram[Range{0, header_size}]);
+
+    auto *ip = reinterpret_cast<IPV4Header *>(frame.begin());
+    auto *tcp = reinterpret_cast<TCPHeader *>(frame.begin() + ip_size);
+    auto *ip_words = reinterpret_cast<const uint16_t *>(frame.begin());
+    auto *tcp_words = reinterpret_cast<const uint16_t *>(frame.begin() + ip_size);
+
+    uint16_t identification = ip->get_identification();
+    uint32_t sequence = tcp->get_sequence();
+    bool push = tcp->get_push(), fin = tcp->get_fin();
+
+    // of the pseudo header and the tcp header alone, patched along with them
+    tcp->set_checksum(0);
+    IPV4PseudoHeader pseudo{*ip};
+    uint16_t tcp_length = htons(pseudo.get_data_length());
+    uint16_t header_checksum = complement_checksum_complement(
+            complement_checksum_sum(pseudo.into_slice()) +
+            complement_checksum_sum(frame[Range{ip_size, header_size}]));
+
+    for (size_t i = 0, offset = 0, size; offset < tcp_data.size(); ++i, offset += size) {
+        size = std::min(segment_size, tcp_data.size() - offset);
+        bool last = offset + size == tcp_data.size();
+
+        uint16_t ip_before[2] = {ip_words[1], ip_words[2]};
+        ip->set_total_length(header_size + size);
+        ip->set_identification(identification + i);
+
+        uint16_t ip_checksum = ip->get_checksum();
+        for (size_t j = 0; j < 2; ++j) {
+            ip_checksum = complement_checksum_update(ip_checksum, ip_before[j], ip_words[j + 1]);
+        }
+        ip->set_checksum(ip_checksum);
+
+        // sequence number and flags
+        const size_t index[3] = {2, 3, 6};
+        uint16_t tcp_before[3] = {tcp_words[2], tcp_words[3], tcp_words[6]};
+        tcp->set_sequence(sequence + offset);
+        tcp->set_flags(tcp->get_cwr(), tcp->get_ece(), false, tcp->get_ack(), push && last,
+                       tcp->get_reset(), tcp->get_sync(), fin && last);
+
+        for (size_t j = 0; j < 3; ++j) {
+            header_checksum = complement_checksum_update(header_checksum, tcp_before[j],
+                                                         tcp_words[index[j]]);
+        }
+
+        uint16_t length = htons(header_size - ip_size + size);
+        header_checksum = complement_checksum_update(header_checksum, tcp_length, length);
+        tcp_length = length;
+
+        auto payload = frame[Range{header_size}][Range{0, size}];
+        payload.copy_from_slice(tcp_data[Range{offset}][Range{0, size}]);
+
+        tcp->set_checksum(complement_checksum_complement(
+                static_cast<uint16_t>(~header_checksum) + complement_checksum_sum(payload)));
+
+        if (!func(frame[Range{0, header_size + size}])) { break; }
+    }
+
+    return true;
+}
+
+
+/// generic receive offload, merges consecutive in order segments of one flow into one larger
+/// segment before they are demultiplexed, so that the protocol handles a burst at once
+///
+/// only segments which differ in nothing but sequence number, identification and payload are
+/// merged, a segment with push or shorter than the first ends the merge, the size of the first
+/// is passed beside the merged segment as for `tcp_gso_segment`, the checksums of the merged
+/// segment are made from the sums of its parts, which are checked on the way
+class TCPCoalescer {
+private:
+    Array<uint8_t> buffer;
+    size_t size;          // bytes held, none if 0
+    size_t header_size;   // of the ip and tcp headers held
+    size_t segment_size;  // payload of the first segment held
+    size_t count;         // segments merged
+    uint32_t next_seq;    // which a segment must start at to be appended
+    uint32_t payload_sum; // of the payload held
+
+    /// the headers and the checksum sum of the payload of a data segment with nothing but ack
+    /// and push, and valid checksums
+    static bool check(Slice<uint8_t> datagram, const IPV4Header *&ip_header,
+                      const TCPHeader *&tcp_header, Slice<uint8_t> &tcp_data, uint32_t &sum) {
+        auto[ip, ip_option, ip_data] = ipv4_split(datagram);
+        if (ip == nullptr || ip->get_protocol() != IPV4Protocol::TCP ||
+            ip->get_more_fragment() || ip->get_fragment_offset() != 0 ||
+            complement_checksum(ip->into_slice()) != 0) { return false; }
+
+        auto[tcp, tcp_option, data] = tcp_split(ip_data);
+        if (tcp == nullptr || data.empty() || !tcp->get_ack() || tcp->get_urgent() ||
+            tcp->get_reset() || tcp->get_sync() || tcp->get_fin() || tcp->get_cwr() ||
+            tcp->get_ece()) { return false; }
+
+        IPV4PseudoHeader pseudo{*ip};
+        sum = complement_checksum_sum(data);
+
+        uint32_t header_sum = complement_checksum_sum(pseudo.into_slice()) +
+                              complement_checksum_sum(ip_data[Range{0, tcp->get_header_length()}]);
+        if (complement_checksum_complement(header_sum + sum) != 0) { return false; }
+
+        ip_header = ip;
+        tcp_header = tcp;
+        tcp_data = data;
+
+        return true;
+    }
+
+    bool append(Slice<uint8_t> datagram) {
+        const IPV4Header *ip_header = nullptr;
+        const TCPHeader *tcp_header = nullptr;
+        Slice<uint8_t> tcp_data{};
+        uint32_t sum = 0;
+
+        if (!check(datagram, ip_header, tcp_header, tcp_data, sum)) { return false; }
+
+        auto *held_ip = reinterpret_cast<const IPV4Header *>(buffer.begin());
+        size_t ip_size = held_ip->get_header_length();
+
+        if (ip_header->get_header_length() != ip_size ||
+            ip_size + tcp_header->get_header_length() != header_size ||
+            ip_header->get_src_ip() != held_ip->get_src_ip() ||
+            ip_header->get_dest_ip() != held_ip->get_dest_ip() ||
+            tcp_header->get_sequence() != next_seq || tcp_data.size() > segment_size ||
+            size + tcp_data.size() > buffer.size()) { return false; }
+
+        // ports, ack number, flags but push, window and options
+        auto held = buffer[Range{ip_size, header_size}];
+        auto next = datagram[Range{ip_size, header_size}];
+        if (std::memcmp(held.begin(), next.begin(), 4) != 0 ||
+            std::memcmp(held.begin() + 8, next.begin() + 8, 5) != 0 ||
+            (held[13] | TCPHeader::FLAGS_PUSH) != (next[13] | TCPHeader::FLAGS_PUSH) ||
+            std::memcmp(held.begin() + 14, next.begin() + 14, 2) != 0 ||
+            std::memcmp(held.begin() + 20, next.begin() + 20, held.size() - 20) != 0) {
+            return false;
+        }
+
+        // the sum of data at an odd offset is the sum with the bytes swapped
+        if ((size & 1) != 0) {
+            while ((sum >> 16u) != 0) { sum = (sum & 0xffffu) + (sum >> 16u); }
+            sum = ((sum & 0xffu) << 8u) | (sum >> 8u);
+        }
+
+        buffer[Range{size}][Range{0, tcp_data.size()}].copy_from_slice(tcp_data);
+        size += tcp_data.size();
+        payload_sum += sum;
+        next_seq += tcp_data.size();
+        ++count;
+
+        if (tcp_header->get_push()) { held[13] |= TCPHeader::FLAGS_PUSH; }
+
+        return true;
+    }
+
+    /// nothing may follow the last segment held
+    bool is_closed() const {
+        auto *ip_header = reinterpret_cast<const IPV4Header *>(buffer.begin());
+        auto *tcp_header = reinterpret_cast<const TCPHeader *>(
+                buffer.begin() + ip_header->get_header_length());
+
+        return tcp_header->get_push() || (size - header_size) % segment_size != 0;
+    }
+
+public:
+    explicit TCPCoalescer(size_t capacity) :
+            buffer{capacity}, size{0}, header_size{0}, segment_size{0}, count{0}, next_seq{0},
+            payload_sum{0} {}
+
+    TCPCoalescer(TCPCoalescer &&other) noexcept = default;
+
+    TCPCoalescer &operator=(TCPCoalescer &&other) noexcept = default;
+
+    bool empty() const { return size == 0; }
+
+    /// pass on what is held as one segment to `func`, with the size of the segments merged in
+    /// it, or 0 if it is a single one
+    template<typename F>
+    void flush(F &&func) {
+        if (size == 0) { return; }
+
+        auto datagram = buffer[Range{0, size}];
+        size = 0;
+
+        if (count > 1) {
+            auto *ip_header = reinterpret_cast<IPV4Header *>(datagram.begin());
+            ip_header->set_total_length(datagram.size());
+            ip_header->set_checksum(0);
+            ip_header->set_checksum(complement_checksum(ip_header->into_slice()));
+
+            size_t ip_size = ip_header->get_header_length();
+            auto *tcp_header = reinterpret_cast<TCPHeader *>(datagram.begin() + ip_size);
+            tcp_header->set_checksum(0);
+
+            IPV4PseudoHeader pseudo{*ip_header};
+            tcp_header->set_checksum(complement_checksum_complement(
+                    complement_checksum_sum(pseudo.into_slice()) +
+                    complement_checksum_sum(datagram[Range{ip_size, header_size}]) + payload_sum));
+        }
+
+        func(Slice<uint8_t>{datagram}, static_cast<uint16_t>(count > 1 ? segment_size : 0));
+    }
+
+    /// take `datagram`, passing it or what can no longer grow to `func` in the order received
+    template<typename F>
+    void push(Slice<uint8_t> datagram, F &&func) {
+        if (size != 0 && append(datagram)) {
+            if (is_closed()) { flush(func); }
+            return;
+        }
+
+        flush(func);
+
+        const IPV4Header *ip_header = nullptr;
+        const TCPHeader *tcp_header = nullptr;
+        Slice<uint8_t> tcp_data{};
+        uint32_t sum = 0;
+
+        if (!check(datagram, ip_header, tcp_header, tcp_data, sum) || tcp_header->get_push() ||
+            ip_header->get_total_length() > buffer.size()) {
+            func(datagram, static_cast<uint16_t>(0));
+            return;
+        }
+
+        size = ip_header->get_total_length();
+        buffer[Range{0, size}].copy_from_slice(datagram[Range{0, size}]);
+        header_size = size - tcp_data.size();
+        segment_size = tcp_data.size();
+        count = 1;
+        next_seq = tcp_header->get_sequence() + tcp_data.size();
+        payload_sum = sum;
+    }
+
+    ~TCPCoalescer() = default;
+};
 }
 
 
@@ -18,7 +18,7 @@ private:
     uint16_t checksum;
 
 public:
-    static size_t max_payload(size_t mtu) {
+    static constexpr size_t max_payload(size_t mtu) {
         return IPV4Header::max_payload(mtu) - sizeof(UDPHeader);
     }
 
@@ -31,15 +31,15 @@ public:
 
     class Guard {
     private:
-        const IPV4Header *ip_header;
         MutSlice<uint8_t> frame;
         MutSlice<uint8_t> inner;
+        uint32_t sum; // of the pseudo header and the header
 
     public:
-        Guard() noexcept: ip_header{nullptr}, frame{}, inner{} {}
+        Guard() noexcept: frame{}, inner{}, sum{0} {}
 
-        Guard(const IPV4Header *ip_header, MutSlice<uint8_t> icmp_frame, MutSlice<uint8_t> inner) :
-                ip_header{ip_header}, frame{icmp_frame} , inner{inner} {}
+        Guard(MutSlice<uint8_t> udp_frame, MutSlice<uint8_t> inner, uint32_t sum) :
+                frame{udp_frame}, inner{inner}, sum{sum} {}
 
         Guard(Guard &&other) noexcept = default;
 
@@ -50,8 +50,11 @@ public:
         MutSlice<uint8_t> *operator->() { return &inner; }
 
         ~Guard() {
+            if (frame.empty()) { return; }
+
             auto *udp_header = reinterpret_cast<UDPHeader *>(frame.begin());
-            udp_header->set_checksum_enable(complement_checksum(*ip_header, frame));
+            udp_header->set_checksum_enable(
+                    complement_checksum_complement(sum + complement_checksum_sum(inner)));
         }
     };
 
@@ -67,13 +70,14 @@ public:
 
         if (udp_frame.empty()) { return {}; }
 
-        auto *udp_header = reinterpret_cast<UDPHeader *>(frame.begin());
+        auto *udp_header = reinterpret_cast<UDPHeader *>(udp_frame.begin());
         new(udp_header)UDPHeader{src_port, dest_port, udp_size};
 
-        return Guard{
-                reinterpret_cast<IPV4Header *>(frame.begin()),
-                udp_frame, udp_frame[Range{sizeof(UDPHeader)}]
-        };
+        IPV4PseudoHeader pseudo{*reinterpret_cast<IPV4Header *>(frame.begin())};
+        uint32_t sum = complement_checksum_sum(pseudo.into_slice()) +
+                       complement_checksum_sum(udp_frame[Range{0, sizeof(UDPHeader)}]);
+
+        return Guard{udp_frame, udp_frame[Range{sizeof(UDPHeader)}], sum};
     }
 
     static const UDPHeader *from_slice(Slice<uint8_t> data) {
@@ -130,6 +134,53 @@ public:
 }__attribute__((packed));
 
 
+/// the ip and udp headers of one flow, built once, a datagram of the flow copies them, patches
+/// the lengths and identification and finishes both checksums from sums taken here
+class UDPHeaderTemplate {
+private:
+    uint8_t header[sizeof(IPV4Header) + sizeof(UDPHeader)];
+    uint32_t ip_sum;  // of the ip header without the total length and identification
+    uint32_t udp_sum; // of the pseudo header without the length, and the ports
+
+public:
+    UDPHeaderTemplate(uint8_t type_of_service, uint32_t src_ip, uint32_t dest_ip,
+                      uint8_t time_to_live, uint16_t src_port, uint16_t dest_port) : header{} {
+        auto *ip_header = new(header)IPV4Header{type_of_service, 0, IPV4Protocol::UDP,
+                                                src_ip, dest_ip, 0, true, false, time_to_live, 0};
+        ip_header->set_total_length(0);
+
+        new(header + sizeof(IPV4Header))UDPHeader{src_port, dest_port, 0};
+
+        IPV4PseudoHeader pseudo{src_ip, dest_ip, IPV4Protocol::UDP, 0};
+        ip_sum = complement_checksum_sum(ip_header->into_slice());
+        udp_sum = complement_checksum_sum(pseudo.into_slice()) +
+                  complement_checksum_sum(Slice<uint8_t>{header + sizeof(IPV4Header), 4});
+    }
+
+    /// as `UDPHeader::generate` for a datagram of the flow
+    UDPHeader::Guard generate(MutSlice<uint8_t> frame, uint16_t identification,
+                              size_t len) const {
+        size_t udp_size = sizeof(UDPHeader) + len;
+        if (frame.size() < sizeof(IPV4Header) + udp_size) { return {}; }
+
+        frame[Range{0, sizeof(header)}].copy_from_slice(Slice<uint8_t>{header, sizeof(header)});
+
+        auto *ip_header = reinterpret_cast<IPV4Header *>(frame.begin());
+        ip_header->set_total_length(sizeof(IPV4Header) + udp_size);
+        ip_header->set_identification(identification);
+        ip_header->set_checksum(complement_checksum_complement(
+                ip_sum + complement_checksum_sum(frame[Range{2, 6}])));
+
+        auto udp_frame = frame[Range{sizeof(IPV4Header)}][Range{0, udp_size}];
+        reinterpret_cast<UDPHeader *>(udp_frame.begin())->set_length(udp_size);
+
+        // the length is in both the pseudo header and the header
+        return UDPHeader::Guard{udp_frame, udp_frame[Range{sizeof(UDPHeader)}],
+                                udp_sum + 2 * htons(udp_size)};
+    }
+};
+
+
 cs120_static_inline std::pair<UDPHeader *, MutSlice<uint8_t>>
 udp_split(MutSlice<uint8_t> datagram) {
     auto *header = datagram.buffer_cast<UDPHeader>();
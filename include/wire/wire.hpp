@@ -23,7 +23,17 @@ cs120_static_inline uint32_t complement_checksum_sum(Slice<uint8_t> buffer_) {
 }
 
 cs120_static_inline uint16_t complement_checksum_complement(uint32_t sum) {
-    return static_cast<uint16_t>(~((sum & 0xffffu) + (sum >> 16u)));
+    // folding once may carry into the upper half again
+    while ((sum >> 16u) != 0) { sum = (sum & 0xffffu) + (sum >> 16u); }
+    return static_cast<uint16_t>(~sum);
+}
+
+/// RFC 1624, the checksum once a 16 bit word it covers goes from `old_value` to `new_value`,
+/// the words as they are in memory
+cs120_static_inline uint16_t complement_checksum_update(uint16_t checksum, uint16_t old_value,
+                                                        uint16_t new_value) {
+    uint32_t sum = static_cast<uint16_t>(~checksum) + static_cast<uint16_t>(~old_value);
+    return complement_checksum_complement(sum + new_value);
 }
 
 /// RFC 1071
@@ -38,12 +38,22 @@ bool FTPClient::send_printf(const char *format, ...) {
 
     if (msg.empty()) { return false; }
 
+    // one command may take several writes, let it leave as one segment
+    control->cork();
+
+    bool result = true;
+
     for (size_t offset = 0, size = 0; offset < msg.size(); offset += size) {
-        size = control->send(msg[Range{size}]);
-        if (size == 0) { return false; }
+        size = control->send(msg[Range{offset}]);
+        if (size == 0) {
+            result = false;
+            break;
+        }
     }
 
-    return true;
+    control->uncork();
+
+    return result;
 }
 
 Slice<uint8_t> FTPClient::recv_line() {
@@ -161,12 +171,14 @@ bool FTPClient::list(const char *path) {
             return false;
     }
 
-    Buffer<uint8_t, BUFF_LEN> buffer{};
     for (;;) {
-        size_t size = data->recv(buffer[Range{}]);
-        if (size == 0) { break; }
+        auto[first, second] = data->peek();
+        if (first.empty()) { break; }
 
-        print_slice(buffer[Range{0, size}]);
+        print_slice(first);
+        print_slice(second);
+
+        data->consume(first.size() + second.size());
     }
 
     data = nullptr;
@@ -197,14 +209,20 @@ bool FTPClient::retr(const char *file_name) {
     int file = open(file_name, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
     if (file < 0) { cs120_abort("open error"); }
 
-    Buffer<uint8_t, BUFF_LEN> buffer{};
+    // straight from the receive buffer to the file
     for (;;) {
-        size_t size = data->recv(buffer[Range{}]);
-        if (size == 0) { break; }
+        auto[first, second] = data->peek();
+        if (first.empty()) { break; }
+
+        for (auto &slice: {first, second}) {
+            if (slice.empty()) { continue; }
 
-        if (static_cast<size_t>(write(file, buffer.begin(), size)) != size) {
-            cs120_abort("write error");
+            if (static_cast<size_t>(write(file, slice.begin(), slice.size())) != slice.size()) {
+                cs120_abort("write error");
+            }
         }
+
+        data->consume(first.size() + second.size());
     }
 
     data = nullptr;
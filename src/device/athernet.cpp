@@ -1,9 +1,11 @@
 #include "device/athernet.hpp"
 
 #include <sys/socket.h>
+#include <sys/ioctl.h>
 
 #include "utility.hpp"
 #include "wire/ipv4.hpp"
+#include "wire/tcp.hpp"
 
 
 namespace cs120 {
@@ -17,6 +19,10 @@ void *unix_socket_sender(void *args_) {
         auto slot = args->queue.recv();
         if (slot.none()) { break; }
 
+        // the slot is reused by senders which know nothing of super segments
+        uint16_t segment_size = slot->segment_size;
+        slot->segment_size = 0;
+
         auto *ip_header = slot->buffer_cast<IPV4Header>();
         if (ip_header == nullptr) {
             cs120_warn("invalid package!");
@@ -24,6 +30,24 @@ void *unix_socket_sender(void *args_) {
         }
 
         auto size = ip_header->get_total_length();
+
+        // a tcp super segment is cut here, just before it goes out
+        bool closed = false;
+        if (size >= ATHERNET_MTU && tcp_gso_segment(
+                (*slot)[Range{}], segment_size, buffer[Range{1, ATHERNET_MTU}],
+                [&](Slice<uint8_t> segment) {
+                    buffer[0] = static_cast<uint8_t>(segment.size());
+
+                    ssize_t len = send(args->athernet, buffer.begin(), ATHERNET_MTU, 0);
+                    if (len == 0) { closed = true; }
+                    if (len != 0 && len != ATHERNET_MTU) { cs120_abort("send error"); }
+
+                    return !closed;
+                })) {
+            if (closed) { break; }
+            continue;
+        }
+
         if (size >= ATHERNET_MTU) {
             cs120_warn("package truncated!");
             continue;
@@ -48,14 +72,32 @@ void *unix_socket_receiver(void *args_) {
     Array<uint8_t> mem{ATHERNET_MTU + 3};
     auto buffer = mem[Range{3}];
 
+    TCPCoalescer coalescer{PACKET_BUFFER_SIZE};
+    auto deliver = [&](Slice<uint8_t> datagram, uint16_t segment_size) {
+        args->demultiplexer.send(datagram, segment_size);
+    };
+
     for (;;) {
+        // segments are only merged within a burst, what is held goes on once the link is idle
+        int available = 0;
+        if (!coalescer.empty() &&
+            (ioctl(args->athernet, FIONREAD, &available) != 0 ||
+             static_cast<size_t>(available) < ATHERNET_MTU)) {
+            coalescer.flush(deliver);
+            if (args->demultiplexer.is_close()) { break; }
+        }
+
         ssize_t len = recv(args->athernet, buffer.begin(), ATHERNET_MTU, 0);
 
         if (len == 0) { break; }
         if (len != ATHERNET_MTU) { cs120_abort("recv_line error"); }
 
         size_t size = buffer[0];
-        args->demultiplexer.send(buffer[Range{1, size + 1}]);
+        if (args->coalesce) {
+            coalescer.push(buffer[Range{1, size + 1}], deliver);
+        } else {
+            deliver(buffer[Range{1, size + 1}], 0);
+        }
         if (args->demultiplexer.is_close()) { break; }
     }
 
@@ -33,6 +33,7 @@ AthernetSocket::AthernetSocket(size_t size) :
     auto *receiver_args = new unix_socket_recv_args{
             .athernet = athernet,
             .demultiplexer = Demultiplexer<PacketBuffer>{size},
+            .coalesce = true,
     };
 
     auto *sender_args = new unix_socket_send_args{
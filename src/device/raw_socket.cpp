@@ -8,6 +8,7 @@
 
 #include "wire/wire.hpp"
 #include "wire/ipv4.hpp"
+#include "wire/tcp.hpp"
 
 
 namespace {
@@ -19,37 +20,54 @@ struct raw_socket_sender_args {
     MPSCQueue<PacketBuffer>::Receiver queue;
 };
 
+void raw_socket_write(libnet_t *context, Slice<uint8_t> datagram) {
+    auto[ip_header, ip_option, ip_data] = ipv4_split(datagram);
+    if (ip_header == nullptr) {
+        cs120_warn("invalid package!");
+        return;
+    }
+
+    if (libnet_build_ipv4(ip_header->get_total_length(), ip_header->get_type_of_service(),
+                          ip_header->get_identification(), ip_header->get_fragment(),
+                          ip_header->get_time_to_live(),
+                          static_cast<uint8_t>(ip_header->get_protocol()),
+                          ip_header->get_checksum(), ip_header->get_src_ip(),
+                          ip_header->get_dest_ip(), ip_data.begin(), ip_data.size(),
+                          context, 0) == -1) {
+        cs120_abort(libnet_geterror(context));
+    }
+
+    if (!ip_option.empty() && libnet_build_ipv4_options(
+            ip_option.begin(), ip_option.size(), context, 0) == -1) {
+        cs120_abort(libnet_geterror(context));
+    }
+
+    if (libnet_write(context) == -1) { cs120_warn(libnet_geterror(context)); }
+
+    libnet_clear_packet(context);
+}
+
 void *raw_socket_sender(void *args_) {
     auto *args = reinterpret_cast<raw_socket_sender_args *>(args_);
 
+    Array<uint8_t> segment{ETHERNET_MTU};
+
     for (;;) {
         auto buffer = args->queue.recv();
         if (buffer.none()) { break; }
 
-        auto[ip_header, ip_option, ip_data] = ipv4_split((*buffer)[Range{}]);
-        if (ip_header == nullptr) {
-            cs120_warn("invalid package!");
-            continue;
-        }
-
-        if (libnet_build_ipv4(ip_header->get_total_length(), ip_header->get_type_of_service(),
-                              ip_header->get_identification(), ip_header->get_fragment(),
-                              ip_header->get_time_to_live(),
-                              static_cast<uint8_t>(ip_header->get_protocol()),
-                              ip_header->get_checksum(), ip_header->get_src_ip(),
-                              ip_header->get_dest_ip(), ip_data.begin(), ip_data.size(),
-                              args->context, 0) == -1) {
-            cs120_abort(libnet_geterror(args->context));
-        }
-
-        if (!ip_option.empty() && libnet_build_ipv4_options(
-                ip_option.begin(), ip_option.size(), args->context, 0) == -1) {
-            cs120_abort(libnet_geterror(args->context));
-        }
-
-        if (libnet_write(args->context) == -1) { cs120_warn(libnet_geterror(args->context)); }
-
-        libnet_clear_packet(args->context);
+        // the slot is reused by senders which know nothing of super segments
+        uint16_t segment_size = buffer->segment_size;
+        buffer->segment_size = 0;
+
+        // a tcp super segment is cut here, just before it goes out
+        if (tcp_gso_segment((*buffer)[Range{}], segment_size, segment[Range{}],
+                            [&](Slice<uint8_t> datagram) {
+                                raw_socket_write(args->context, datagram);
+                                return true;
+                            })) { continue; }
+
+        raw_socket_write(args->context, (*buffer)[Range{}]);
     }
 
     libnet_destroy(args->context);
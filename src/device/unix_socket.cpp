@@ -9,7 +9,7 @@
 
 
 namespace cs120 {
-UnixSocket::UnixSocket(size_t size) :
+UnixSocket::UnixSocket(size_t size, bool coalesce) :
         receiver{}, sender{}, recv_queue{}, send_queue{}, athernet{-1} {
     auto[send_sender, send_receiver] = MPSCQueue<PacketBuffer>::channel(size);
 
@@ -29,6 +29,7 @@ UnixSocket::UnixSocket(size_t size) :
     auto *receiver_args = new unix_socket_recv_args{
             .athernet = athernet,
             .demultiplexer = Demultiplexer<PacketBuffer>{size},
+            .coalesce = coalesce,
     };
 
     auto *sender_args = new unix_socket_send_args{
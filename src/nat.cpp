@@ -19,7 +19,7 @@ int main(int argc, char **argv) {
         ip_map[i - 2] = parse_ip_address(argv[i]);
     }
 
-    std::shared_ptr<BaseSocket> lan{new UnixSocket{64}};
+    std::shared_ptr<BaseSocket> lan{new UnixSocket{64, false}};
     std::shared_ptr<BaseSocket> wan{new RawSocket{64}};
 
     NatServer server{lan_ip, wan_addr, lan, wan, 64, ip_map};
@@ -7,48 +7,80 @@
 #include "wire/ipv4.hpp"
 #include "wire/icmp.hpp"
 #include "device/base_socket.hpp"
+#include "server/ipv4_server.hpp"
 
 
 namespace cs120 {
-bool ICMPPing::ping(uint16_t seq) {
-    using namespace std::literals;
+int32_t ICMPPing::parse_reply(Slice<uint8_t> datagram) {
+    auto[ip_header, ip_option, ip_data] = ipv4_split(datagram);
+    if (ip_header == nullptr || complement_checksum(ip_header->into_slice()) != 0) {
+        cs120_warn("invalid package!");
+        return -1;
+    }
+
+    auto[icmp_header, icmp_data] = icmp_split(ip_data);
+    if (icmp_header == nullptr || complement_checksum(ip_data) != 0) {
+        cs120_warn("invalid package!");
+        return -1;
+    }
 
+    auto *echo_data = icmp_data.buffer_cast<ICMPEcho>();
+    if (echo_data == nullptr) {
+        cs120_warn("invalid package!");
+        return -1;
+    }
+
+    return echo_data->get_sequence();
+}
+
+void ICMPPing::generate_request(MutSlice<uint8_t> frame, uint16_t seq) {
     ICMPEcho data{identification, seq, src_port, dest_port};
 
+    uint16_t ip_identification =
+            IPV4IdentificationGenerator::get().next(src_ip, dest_ip, IPV4Protocol::ICMP);
+
+    ICMPHeader::generate(frame, 0, ip_identification, src_ip, dest_ip, 64,
+                         ICMPType::EchoRequest, 0, sizeof(ICMPEcho))
+            ->copy_from_slice(data.into_slice());
+}
+
+bool ICMPPing::request(uint16_t seq) {
+    auto buffer = send_queue.try_send();
+    if (buffer.none()) { return false; }
+
+    generate_request((*buffer)[Range{}], seq);
+
+    return true;
+}
+
+int32_t ICMPPing::try_reply() {
+    for (;;) {
+        auto buffer = recv_queue->try_recv();
+        if (buffer.none()) { return -1; }
+
+        auto seq = parse_reply((*buffer)[Range{}]);
+        if (seq != -1) { return seq; }
+    }
+}
+
+bool ICMPPing::ping(uint16_t seq) {
+    using namespace std::literals;
+
     {
         auto buffer = send_queue.send();
         if (buffer.none()) { return false; }
 
-        ICMPHeader::generate((*buffer)[Range{}], 0, seq + 1, src_ip, dest_ip, 64,
-                             ICMPType::EchoRequest, 0, sizeof(ICMPEcho))
-                ->copy_from_slice(data.into_slice());
+        generate_request((*buffer)[Range{}], seq);
     }
 
-    auto deadline = std::chrono::system_clock::now() + 1s;
+    auto deadline = std::chrono::steady_clock::now() + 1s;
 
     for (;;) {
         auto buffer = recv_queue->recv_deadline(deadline);
         if (buffer.none()) { return false; }
 
-        auto[ip_header, ip_option, ip_data] = ipv4_split((*buffer)[Range{}]);
-        if (ip_header == nullptr || complement_checksum(ip_header->into_slice()) != 0) {
-            cs120_warn("invalid package!");
-            continue;
-        }
-
-        auto[icmp_header, icmp_data] = icmp_split(ip_data);
-        if (icmp_header == nullptr || complement_checksum(ip_data) != 0) {
-            cs120_warn("invalid package!");
-            continue;
-        }
-
-        auto *echo_data = icmp_data.buffer_cast<ICMPEcho>();
-        if (echo_data->get_sequence() != seq) { continue; }
-
-        break;
+        if (parse_reply((*buffer)[Range{}]) == seq) { return true; }
     }
-
-    return true;
 }
 
 void ICMPServer::icmp_receiver() {
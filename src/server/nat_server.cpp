@@ -10,7 +10,8 @@ NatServer::NatServer(uint32_t lan_addr, uint32_t wan_addr, std::shared_ptr<BaseS
         lan_to_wan{}, wan_to_lan{}, lan{lan}, wan{wan},
         lan_sender{}, wan_sender{}, lan_receiver{}, wan_receiver{},
         nat_table{NAT_PORTS_SIZE}, nat_reverse_table{},
-        lowest_free_port{NAT_PORTS_BASE}, wan_addr{wan_addr} {
+        lowest_free_port{NAT_PORTS_BASE}, dynamic_ports_base{NAT_PORTS_BASE},
+        free_ports{}, nat_aging{}, wan_addr{wan_addr} {
     for (auto &end_point: map_addr) {
         if (lowest_free_port >= NAT_PORTS_BASE + NAT_PORTS_SIZE) {
             cs120_abort("nat ports used up!");
@@ -25,6 +26,8 @@ NatServer::NatServer(uint32_t lan_addr, uint32_t wan_addr, std::shared_ptr<BaseS
                end_point.port, wan_port);
     }
 
+    dynamic_ports_base = lowest_free_port;
+
     uint32_t sub_net_mask = inet_addr("255.255.255.0");
     uint32_t sub_net_addr = inet_addr("192.168.1.0");
 
@@ -58,13 +61,53 @@ NatServer::NatServer(uint32_t lan_addr, uint32_t wan_addr, std::shared_ptr<BaseS
     pthread_create(&wan_to_lan, nullptr, nat_wan_to_lan, this);
 }
 
+uint16_t NatServer::nat_map(EndPoint end_point) {
+    auto table_ptr = nat_reverse_table.find(end_point);
+    if (table_ptr != nat_reverse_table.end()) { return table_ptr->second; }
+
+    uint16_t wan_port;
+    if (!free_ports.empty()) {
+        wan_port = free_ports.back();
+        free_ports.pop_back();
+    } else if (lowest_free_port < NAT_PORTS_BASE + NAT_PORTS_SIZE) {
+        wan_port = lowest_free_port++;
+    } else {
+        cs120_abort("nat ports used up!");
+    }
+
+    printf("port mapping add: %s:%d <-> %d\n",
+           inet_ntoa(in_addr{end_point.ip_addr}), end_point.port, wan_port);
+
+    nat_table[wan_port - NAT_PORTS_BASE].store(end_point);
+    nat_reverse_table.emplace(end_point, wan_port);
+
+    return wan_port;
+}
+
+void NatServer::nat_unmap(uint16_t wan_port) {
+    auto end_point = nat_table[wan_port - NAT_PORTS_BASE].load();
+
+    printf("port mapping remove: %s:%d <-> %d\n",
+           inet_ntoa(in_addr{end_point.ip_addr}), end_point.port, wan_port);
+
+    nat_table[wan_port - NAT_PORTS_BASE].store(EndPoint{});
+    nat_reverse_table.erase(end_point);
+    free_ports.push_back(wan_port);
+}
+
 void NatServer::nat_lan_to_wan() {
     uint16_t wan_mtu = wan->get_mtu();
 
     for (;;) {
-        auto receive = lan_receiver->recv();
+        auto receive = nat_aging.empty() ? lan_receiver->recv() :
+                       lan_receiver->recv_deadline(nat_aging.next_deadline());
         if (receive.is_close()) { return; }
 
+        auto current = TimingWheel<uint16_t>::Clock::now();
+        nat_aging.advance(current, [&](uint16_t wan_port) { nat_unmap(wan_port); });
+
+        if (receive.none()) { continue; }
+
         auto[ip_header, ip_option, ip_data] = ipv4_split((*receive)[Range{}]);
         if (ip_header == nullptr || complement_checksum(ip_header->into_slice()) != 0) {
             cs120_warn("invalid package!");
@@ -130,7 +173,11 @@ void NatServer::nat_lan_to_wan() {
             if (send.none()) {
                 cs120_warn("package loss!");
             } else {
-                auto buffer = ICMPHeader::generate((*send)[Range{}], 0, 0, wan_addr, src_ip, 64,
+                uint16_t identification = IPV4IdentificationGenerator::get()
+                        .next(wan_addr, src_ip, IPV4Protocol::ICMP);
+
+                auto buffer = ICMPHeader::generate((*send)[Range{}], 0, identification,
+                                                   wan_addr, src_ip, 64,
                                                    ICMPType::Unreachable,
                                                    ICMPUnreachable::DatagramTooBig,
                                                    icmp_data_size);
@@ -146,25 +193,23 @@ void NatServer::nat_lan_to_wan() {
 
         EndPoint end_point{src_ip, lan_port};
 
-        uint16_t wan_port = 0;
-
-        auto table_ptr = nat_reverse_table.find(end_point);
-        if (table_ptr == nat_reverse_table.end()) {
-            if (lowest_free_port >= NAT_PORTS_BASE + NAT_PORTS_SIZE) {
-                cs120_abort("nat ports used up!");
+        uint16_t wan_port = nat_map(end_point);
+
+        // mappings from `map_addr` are static, everything else ages out
+        if (wan_port >= dynamic_ports_base) {
+            switch (ip_header->get_protocol()) {
+                case IPV4Protocol::ICMP:
+                    nat_aging.schedule(wan_port, current + ICMP_TIMEOUT);
+                    break;
+                case IPV4Protocol::UDP:
+                    nat_aging.schedule(wan_port, current + UDP_TIMEOUT);
+                    break;
+                case IPV4Protocol::TCP:
+                    nat_aging.schedule(wan_port, current + TCP_TIMEOUT);
+                    break;
+                default:
+                    cs120_unreachable("checked before!");
             }
-
-            wan_port = lowest_free_port++;
-
-            printf("port mapping add: %s:%d <-> %d\n",
-                   inet_ntoa(in_addr{src_ip}), lan_port, wan_port);
-
-            size_t index = wan_port - NAT_PORTS_BASE;
-
-            nat_table[index].store(end_point);
-            nat_reverse_table.emplace(end_point, wan_port);
-        } else {
-            wan_port = table_ptr->second;
         }
 
         ip_header->set_time_to_live(ip_header->get_time_to_live() - 1);
@@ -297,7 +342,11 @@ void NatServer::nat_wan_to_lan() {
             if (send.none()) {
                 cs120_warn("package loss!");
             } else {
-                auto buffer = ICMPHeader::generate((*send)[Range{}], 0, 0, wan_addr, src_ip, 64,
+                uint16_t identification = IPV4IdentificationGenerator::get()
+                        .next(wan_addr, src_ip, IPV4Protocol::ICMP);
+
+                auto buffer = ICMPHeader::generate((*send)[Range{}], 0, identification,
+                                                   wan_addr, src_ip, 64,
                                                    ICMPType::Unreachable,
                                                    ICMPUnreachable::DatagramTooBig,
                                                    icmp_data_size);
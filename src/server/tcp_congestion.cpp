@@ -0,0 +1,228 @@
+#include "server/tcp_congestion.hpp"
+
+#include <cmath>
+
+#include "utility.hpp"
+
+
+namespace cs120 {
+std::unique_ptr<TCPCongestionControl>
+TCPCongestionControl::create(TCPCongestionAlgorithm algorithm, uint32_t mss, uint32_t threshold) {
+    switch (algorithm) {
+        case TCPCongestionAlgorithm::Reno:
+            return std::unique_ptr<TCPCongestionControl>{new TCPReno{mss, threshold}};
+        case TCPCongestionAlgorithm::Cubic:
+            return std::unique_ptr<TCPCongestionControl>{new TCPCubic{mss, threshold}};
+        case TCPCongestionAlgorithm::Delay:
+            return std::unique_ptr<TCPCongestionControl>{new TCPDelay{mss, threshold}};
+        default:
+            cs120_unreachable("unknown congestion control!");
+    }
+}
+
+void TCPReno::on_ack(uint32_t acked, uint32_t flight, Duration rtt) {
+    (void) flight;
+    (void) rtt;
+
+    transmitted += acked;
+
+    if (transmitted >= window) {
+        transmitted -= window;
+
+        if (window == threshold) {
+            // additive increasing
+            window += mss;
+            threshold += mss;
+        } else {
+            // slow start
+            window = std::min(window * 2, threshold);
+        }
+    }
+}
+
+void TCPReno::on_loss(uint32_t flight) {
+    threshold = std::max(flight / 2 / mss * mss, 2 * mss);
+    window = threshold;
+    transmitted = 0;
+}
+
+void TCPReno::on_rto(uint32_t flight) {
+    (void) flight;
+
+    // multiplicative decreasing
+    threshold = std::max(threshold / mss / 2 * mss, mss);
+    window = mss;
+    transmitted = 0;
+}
+
+void TCPCubic::reduce() {
+    // fast convergence, release bandwidth for newer flows when the window keeps falling
+    if (window < last_max) {
+        last_max = window * (1 + BETA) / 2;
+    } else {
+        last_max = window;
+    }
+
+    threshold = std::max(static_cast<uint32_t>(window * BETA), 2 * mss);
+    epoch_started = false;
+}
+
+void TCPCubic::on_ack(uint32_t acked, uint32_t flight, Duration rtt) {
+    (void) flight;
+
+    if (rtt.count() > 0 && (min_rtt.count() == 0 || rtt < min_rtt)) { min_rtt = rtt; }
+
+    if (window < threshold) {
+        window += std::min(acked, 2 * mss);
+        return;
+    }
+
+    auto current = Clock::now();
+
+    if (!epoch_started) {
+        epoch_started = true;
+        epoch = current;
+        estimate = window;
+
+        if (window < last_max) {
+            k = std::cbrt((last_max - window) / mss / C);
+        } else {
+            k = 0;
+            last_max = window;
+        }
+    }
+
+    // the window one round trip ahead
+    double time = std::chrono::duration<double>(current - epoch + min_rtt).count();
+    double target = C * std::pow(time - k, 3) * mss + last_max;
+    target = std::min(std::max<double>(target, window), 1.5 * window);
+
+    // the reno friendly region, additive increase with the same average as reno
+    estimate += 3 * (1 - BETA) / (1 + BETA) * acked / window * mss;
+
+    double next = std::max(target, estimate);
+    if (next > window) {
+        window += std::max<uint32_t>(static_cast<uint32_t>((next - window) * acked / window), 1);
+    }
+}
+
+void TCPCubic::on_loss(uint32_t flight) {
+    (void) flight;
+
+    reduce();
+    window = threshold;
+}
+
+void TCPCubic::on_rto(uint32_t flight) {
+    (void) flight;
+
+    reduce();
+    window = mss;
+}
+
+uint32_t TCPDelay::get_target(double gain) const {
+    double product = bandwidth * std::chrono::duration<double>(min_rtt).count();
+    return std::max(static_cast<uint32_t>(gain * product), 4 * mss);
+}
+
+void TCPDelay::on_round(uint32_t flight) {
+    switch (state) {
+        case State::Startup:
+            // the pipe is full once three rounds fail to raise the bandwidth by a quarter
+            if (bandwidth >= full_bandwidth * 1.25) {
+                full_bandwidth = bandwidth;
+                full_bandwidth_count = 0;
+            } else if (++full_bandwidth_count >= 3) {
+                state = State::Drain;
+            }
+            break;
+        case State::Drain:
+            if (flight <= get_target(1)) {
+                state = State::ProbeBandwidth;
+                cycle = 0;
+            }
+            break;
+        case State::ProbeBandwidth:
+            cycle = (cycle + 1) % PROBE_GAIN.size();
+            break;
+        default:
+            cs120_unreachable("unknown state!");
+    }
+}
+
+void TCPDelay::on_send(uint32_t flight) {
+    // restarting after idle, the time the pipe stayed empty is not a delivery rate
+    if (flight == 0) {
+        delivered = 0;
+        round_start = Clock::now();
+    }
+}
+
+void TCPDelay::on_ack(uint32_t acked, uint32_t flight, Duration rtt) {
+    auto current = Clock::now();
+
+    if (rtt.count() > 0 &&
+        (min_rtt.count() == 0 || rtt <= min_rtt || current - min_rtt_stamp > MIN_RTT_EXPIRE)) {
+        min_rtt = rtt;
+        min_rtt_stamp = current;
+    }
+
+    delivered += acked;
+
+    // one delivery rate sample per round trip
+    if (min_rtt.count() > 0 && current - round_start >= min_rtt) {
+        double rate = delivered / std::chrono::duration<double>(current - round_start).count();
+
+        samples[round++ % samples.size()] = rate;
+        bandwidth = *std::max_element(samples.begin(), samples.end());
+
+        delivered = 0;
+        round_start = current;
+
+        on_round(flight);
+    }
+
+    if (bandwidth == 0) {
+        window += acked;
+    } else if (state == State::Startup) {
+        if (window < get_target(STARTUP_GAIN)) { window += acked; }
+    } else {
+        window = std::min(window + acked, get_target(WINDOW_GAIN));
+    }
+}
+
+void TCPDelay::on_loss(uint32_t flight) {
+    if (bandwidth == 0) {
+        // no model yet, nothing better than halving
+        window = std::max(flight / 2, 4 * mss);
+        return;
+    }
+
+    // losses while probing mean the pipe is already full
+    if (state == State::Startup) { state = State::Drain; }
+
+    // a loss says little about congestion on the acoustic link, only stop growing past it
+    window = std::max(std::min(window, flight), 4 * mss);
+}
+
+void TCPDelay::on_rto(uint32_t flight) {
+    (void) flight;
+
+    window = mss;
+    delivered = 0;
+    round_start = Clock::now();
+}
+
+uint64_t TCPDelay::pacing_rate() const {
+    switch (state) {
+        case State::Startup:
+            return static_cast<uint64_t>(STARTUP_GAIN * bandwidth);
+        case State::Drain:
+            return static_cast<uint64_t>(bandwidth / STARTUP_GAIN);
+        case State::ProbeBandwidth:
+            return static_cast<uint64_t>(PROBE_GAIN[cycle] * bandwidth);
+        default:
+            cs120_unreachable("unknown state!");
+    }
+}
+}
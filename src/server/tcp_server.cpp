@@ -6,47 +6,14 @@
 
 #include "wire/ipv4.hpp"
 #include "wire/tcp.hpp"
+#include "timing_wheel.hpp"
 
 
 namespace cs120 {
-ssize_t TCPSender::send(Slice<uint8_t> data) {
-    std::unique_lock<std::mutex> sender_guard{sender_lock};
+ssize_t TCPSender::sendv(Slice<Slice<uint8_t>> data) {
+    if (!buffer.wait_writable()) { return 0; }
 
-    if (index_increase(buffer_end, 1) == buffer_start) {
-        if (closed) { return 0; }
-
-        std::unique_lock<std::mutex> guard{lock};
-
-        while (index_increase(buffer_end, 1) == buffer_start) {
-            if (closed) { return 0; }
-
-            full.wait(guard);
-        }
-    }
-
-    uint32_t start = buffer_start;
-    start = start == 0 ? buffer.size() - 1 : start - 1;
-
-    size_t size = 0;
-
-    if (start > buffer_end) {
-        size_t len = std::min(data.size() - size, start - buffer_end);
-        buffer[Range{buffer_end}][Range{0, len}].copy_from_slice(data[Range{0, len}]);
-        size += len;
-    } else {
-        size_t len = std::min(data.size() - size, buffer.size() - buffer_end);
-        buffer[Range{buffer_end}][Range{0, len}].copy_from_slice(data[Range{0, len}]);
-        size += len;
-        if (size < buffer.size()) {
-            len = std::min(static_cast<uint32_t>(data.size() - size), start);
-            buffer[Range{0, len}].copy_from_slice(data[Range{size}][Range{0, len}]);
-            size += len;
-        }
-    }
-
-    buffer_end = index_increase(buffer_end, size);
-
-    return size;
+    return buffer.writev(data);
 }
 
 uint32_t TCPSender::ack_update(uint32_t ack) {
@@ -63,18 +30,27 @@ uint32_t TCPSender::ack_update(uint32_t ack) {
         size -= 1;
     }
 
-    if (size > 0) {
-        buffer_start = index_increase(buffer_start, size);
-        full.notify_all();
-    }
+    if (size > 0) { buffer.consume(size); }
+
+    scoreboard.trim(ack);
 
     return size;
 }
 
+void TCPSender::sack_update(const TCPSACKBlocks &blocks) {
+    for (size_t i = 0; i < blocks.size; ++i) {
+        uint32_t seq = blocks.blocks[i][0], end = blocks.blocks[i][1];
+
+        if (tcp_seq_before(seq, ack_receive)) { seq = ack_receive; }
+        if (!tcp_seq_before(seq, end) || tcp_seq_before(frame_send, end)) { continue; }
+
+        // reported ranges only save retransmissions, one that does not fit is forgotten
+        scoreboard.insert(ack_receive, seq, end);
+    }
+}
+
 void TCPReceiver::accept(uint32_t seq, Slice<uint8_t> data) {
     uint32_t buffer_seq = seq - frame_receive;
-    uint32_t buffer_offset = buffer_seq + buffer_end;
-    if (buffer_offset >= buffer.size()) { buffer_offset -= buffer.size(); }
 
     uint32_t window = get_window();
 
@@ -87,306 +63,932 @@ void TCPReceiver::accept(uint32_t seq, Slice<uint8_t> data) {
         uint32_t size = std::min(static_cast<uint32_t>(data.size()), window - buffer_seq);
         if (size == 0) { return; }
 
-        if (buffer_offset + size <= buffer.size()) {
-            buffer[Range{buffer_offset}][Range{0, size}].copy_from_slice(data[Range{0, size}]);
+        // with no room to track another hole, a segment out of order is dropped and comes
+        // again, one in order touches none of the ranges held and is taken all the same, it is
+        // what lets them drain
+        auto *range = fragments.insert(frame_receive, seq, seq + size);
+        if (range == nullptr && buffer_seq != 0) { return; }
+
+        buffer.write_at(buffer_seq, data[Range{0, size}]);
+
+        if (range == nullptr || range->seq == frame_receive) {
+            uint32_t ready = size;
+            if (range != nullptr) {
+                ready = range->end - range->seq;
+                fragments.pop_front();
+            }
+
+            frame_receive += ready;
+            buffer.commit(ready);
+
+            if (closed && frame_receive == close_seq) {
+                ++frame_receive;
+                buffer.close();
+            }
         } else {
-            uint32_t cut = buffer.size() - buffer_offset;
-            buffer[Range{buffer_offset}].copy_from_slice(data[Range{0, cut}]);
-            buffer[Range{0, size - cut}].copy_from_slice(data[Range{cut, size}]);
+            last_fragment = range->seq;
+        }
+    }
+}
+
+TCPSACKBlocks TCPReceiver::get_sack() const {
+    TCPSACKBlocks blocks{};
+
+    if (!sack || fragments.empty()) { return blocks; }
+
+    // RFC 2018, the block holding the most recent segment goes first
+    for (auto &range: fragments) {
+        if (range.seq == last_fragment) { blocks.push(range.seq, range.end); }
+    }
+
+    for (auto &range: fragments) {
+        if (range.seq == last_fragment) { continue; }
+        if (!blocks.push(range.seq, range.end)) { break; }
+    }
+
+    return blocks;
+}
+
+ssize_t TCPReceiver::recvv(Slice<MutSlice<uint8_t>> data) {
+    if (!buffer.wait_readable()) { return 0; }
+
+    return buffer.readv(data);
+}
+
+void TCPReceiver::close(uint32_t seq) {
+    close_seq = seq;
+    closed = true;
+
+    if (frame_receive == close_seq) {
+        ++frame_receive;
+        buffer.close();
+    }
+}
+
+TCPConnection::TCPConnection(std::shared_ptr<BaseSocket> &device, size_t size, EndPoint local,
+                             EndPoint remote, size_t send_size, size_t receive_size,
+                             TCPCongestionAlgorithm algorithm,
+                             MPSCQueue<Request>::Receiver &&requests) :
+        local{local}, remote{remote}, mtu{device->get_mtu()},
+        send_size{send_size}, receive_size{receive_size}, algorithm{algorithm},
+        send_queue{}, recv_queue{}, request_receiver{std::move(requests)},
+        lock{}, established{}, state{State::Closed}, waker{nullptr}, token{0},
+        sender{nullptr}, receiver{nullptr},
+        timer{},
+        local_mss{static_cast<uint16_t>(TCPHeader::max_payload(
+                IPV4PathMTUCache::get().query(remote.ip_addr, mtu)))},
+        remote_mss{0}, local_scale{tcp_window_scale(receive_size)},
+        remote_scale{0}, scale{false}, sack{false}, timestamp{false}, ts_recent{0},
+        local_seq{0}, remote_seq{0}, local_window{static_cast<uint32_t>(receive_size - 1)},
+        remote_window{0}, option{local_mss, local_scale},
+        sync{false}, ack{false}, retransmitted{false}, passive{false}, sync_retries{0},
+        sync_start{}, sync_deadline{},
+        congestion{nullptr}, transmitting{0}, last_ack_count{0}, recover{0}, recovery{false},
+        inflation{0}, pace_next{}, paced{false}, ack_deadline{},
+        retransmit_next{0}, timing{false}, timing_seq{0}, timing_start{}, timeout{},
+        prediction{} {
+    auto[send, recv] = device->bind([=](auto ip_header, auto ip_option, auto ip_data) {
+        (void) ip_option;
+        (void) ip_data;
+
+        if (ip_header->get_protocol() != IPV4Protocol::TCP ||
+            ip_header->get_dest_ip() != local.ip_addr ||
+            ip_header->get_src_ip() != remote.ip_addr) { return false; }
+
+        auto[tcp_header, tcp_option, tcp_data] = tcp_split(ip_data);
+        if (tcp_header == nullptr) {
+            cs120_warn("invalid package!");
+            return false;
         }
 
-        uint32_t new_offset = seq, new_size = size;
+        if (tcp_header->get_dest_port() != local.port ||
+            tcp_header->get_src_port() != remote.port) { return false; }
+
+        return true;
+    }, size);
+
+    send_queue = std::move(send);
+    recv_queue = std::move(recv);
+}
+
+void TCPConnection::generate_sync() {
+    // the window of a segment with syn is never scaled
+    uint16_t window = std::min<size_t>(local_window, std::numeric_limits<uint16_t>::max());
+
+    auto buffer = send_queue.try_send().unwrap();
+    if (buffer.none()) {
+        cs120_warn("package lost!");
+        return;
+    }
+
+    TCPSegmentOption sync_option{};
+
+    if (passive) {
+        // only what the remote has offered
+        sync_option.push(option.mss.into_slice());
+        if (scale) { sync_option.push(option.scale.into_slice()); }
+        if (sack) { sync_option.push(option.sack.into_slice()); }
+        if (timestamp) {
+            sync_option.push(TCPOptionTime{tcp_timestamp(), ts_recent}.into_slice());
+        }
+    } else {
+        sync_option.push(option.into_slice());
+    }
 
-        auto after = fragments.upper_bound(seq + size);
-        if (after != fragments.begin()) {
-            auto tmp = after;
-            --tmp;
-            if (tmp->first + tmp->second > seq + size) {
-                new_size = tmp->first + tmp->second - seq;
+    TCPHeader::generate((*buffer)[Range{}], 0,
+                        IPV4IdentificationGenerator::get().next(local.ip_addr, remote.ip_addr,
+                                                                IPV4Protocol::TCP),
+                        local.ip_addr, remote.ip_addr, 64,
+                        local.port, remote.port, local_seq, passive ? remote_seq : 0,
+                        false, false, false, false, passive, false, false, true, false,
+                        window, sync_option.into_slice(), 0);
+}
+
+void TCPConnection::handshake(Slice<uint8_t> datagram, TimePoint current) {
+    auto[ip_header, ip_option, ip_data] = ipv4_split(datagram);
+    if (ip_header == nullptr || complement_checksum(ip_header->into_slice()) != 0) {
+        cs120_warn("invalid package!");
+        return;
+    }
+
+    auto[tcp_header, tcp_option, tcp_data] = tcp_split(ip_data);
+    if (tcp_header == nullptr || complement_checksum(*ip_header, ip_data) != 0) {
+        cs120_warn("invalid package!");
+        return;
+    }
+
+    uint32_t ts_echo = 0;
+
+    TCPOptionIter iter{tcp_option};
+    // todo
+    for (auto item = iter.next(); !iter.is_end(item); item = iter.next()) {
+        auto[op, data] = item;
+
+        switch (op) {
+            case TCPOption::End:
+                break;
+            case TCPOption::NoOperation:
+                break;
+            case TCPOption::MaximumSegmentSize:
+                remote_mss = (static_cast<uint16_t>(data[0]) << 8) |
+                             (static_cast<uint16_t>(data[1]) << 0);
+                break;
+            case TCPOption::WindowScaleFactor:
+                remote_scale = std::min(data[0], TCPOptionScale::MAX_SCALE);
+                scale = true;
+                break;
+            case TCPOption::SACKPermitted:
+                sack = true;
+                break;
+            case TCPOption::SACK:
+                break;
+            case TCPOption::Echo:
+                break;
+            case TCPOption::EchoReply:
+                break;
+            case TCPOption::Timestamp:
+                if (data.size() != 8) { break; }
+                timestamp = true;
+                ts_recent = ntohl(*reinterpret_cast<const uint32_t *>(&data[0]));
+                if (tcp_header->get_ack()) {
+                    ts_echo = ntohl(*reinterpret_cast<const uint32_t *>(&data[4]));
+                }
+                break;
+            default:
+                cs120_warn("unknown tcp option type!");
+        }
+    }
+
+    if (!tcp_header->check_flags()) {
+        // todo
+    }
+
+    if (tcp_header->get_fin()) {
+        // todo
+    }
+
+    if (tcp_header->get_reset()) {
+        // todo
+    }
+
+    if (tcp_header->get_ack()) {
+        if (ack) {
+            if (local_seq + 1 != tcp_header->get_ack_number()) {
+                // todo
+            }
+        } else if (passive && local_seq + 1 != tcp_header->get_ack_number()) {
+            // not an ack of our syn
+            return;
+        } else {
+            ack = true;
+            local_seq = tcp_header->get_ack_number();
+
+            if (ts_echo != 0) {
+                timer.sample(std::chrono::milliseconds{tcp_timestamp() - ts_echo});
+            } else if (!retransmitted) {
+                timer.sample(std::chrono::duration_cast<TCPRetransmissionTimer::Duration>(
+                        current - sync_start));
             }
         }
+    }
+
+    if (tcp_header->get_sync()) {
+        if (sync) {
+            if (remote_seq != tcp_header->get_sequence() + 1) {
+                // todo
+            }
+        } else {
+            sync = true;
+            remote_seq = tcp_header->get_sequence() + 1;
 
-        auto before = fragments.upper_bound(seq);
-        if (before != fragments.begin()) {
-            auto tmp = before;
-            --tmp;
-            if (tmp->first + tmp->second >= seq) {
-                new_size += new_offset - tmp->first;
-                new_offset = tmp->first;
-                --before;
+            // RFC 7323, scaling is only in effect when both sides have sent the option
+            if (!scale) {
+                local_scale = 0;
+                remote_scale = 0;
             }
         }
 
-        fragments.erase(before, after);
+        remote_window = tcp_header->get_window();
 
-        if (new_offset == frame_receive) {
-            frame_receive += new_size;
-            buffer_end = index_increase(buffer_end, new_size);
+        // the remote has not seen our syn yet
+        if (passive && !ack) {
+            generate_sync();
+            return;
+        }
 
-            if (frame_receive == close_seq) { ++frame_receive; }
+        TCPSegmentOption ack_option{};
+        if (timestamp) {
+            ack_option.push(TCPOptionTime{tcp_timestamp(), ts_recent}.into_slice());
+        }
 
-            empty.notify_all();
+        auto buffer = send_queue.try_send().unwrap();
+        if (buffer.none()) {
+            cs120_warn("package lost!");
         } else {
-            fragments.emplace(new_offset, new_size);
+            TCPHeader::generate((*buffer)[Range{}], 0,
+                                IPV4IdentificationGenerator::get().next(
+                                        local.ip_addr, remote.ip_addr, IPV4Protocol::TCP),
+                                local.ip_addr, remote.ip_addr, 64,
+                                local.port, remote.port, local_seq, remote_seq,
+                                false, false, false, false, true, false, false, false, false,
+                                std::min<size_t>(local_window >> local_scale,
+                                                 std::numeric_limits<uint16_t>::max()),
+                                ack_option.into_slice(), 0);
         }
+    } else {
+        remote_window = tcp_header->get_window() << remote_scale;
     }
+
+    if (!ack || !sync) { return; }
+
+    establish();
 }
 
-ssize_t TCPReceiver::recv(MutSlice<uint8_t> data) {
-    std::unique_lock<std::mutex> receiver_guard{receiver_lock};
+void TCPConnection::establish() {
+    // a missing option, or a zero one, leaves the default
+    uint16_t mss = std::min(local_mss, remote_mss == 0 ? TCPOptionMSS::DEFAULT : remote_mss);
+
+    sender = std::shared_ptr<TCPSender>(new TCPSender{
+            local, remote, local_seq, remote_seq, mss, local_scale,
+            local_window, remote_window, send_size, sack, timestamp, ts_recent
+    });
+    receiver = std::shared_ptr<TCPReceiver>(new TCPReceiver{
+            local, remote, local_seq, remote_seq, mss, remote_scale, receive_size, sack,
+            timestamp, ts_recent
+    });
 
-    if (buffer_start == buffer_end) {
-        if (finished()) { return 0; }
+    congestion = TCPCongestionControl::create(algorithm, sender->mss, sender->remote_window);
+    recover = sender->frame_send - 1;
+    retransmit_next = sender->frame_send;
 
-        std::unique_lock<std::mutex> guard{lock};
+    std::unique_lock<std::mutex> guard{lock};
+    state = State::Established;
+    established.notify_all();
 
-        while (buffer_start == buffer_end) {
-            if (finished()) { return 0; }
+    if (waker != nullptr) {
+        sender->buffer.set_waker(waker, token);
+        receiver->buffer.set_waker(waker, token);
+    }
+}
 
-            empty.wait(guard);
+void TCPConnection::receive(Slice<uint8_t> datagram, uint16_t segment_size, TimePoint current) {
+    auto[ip_header, ip_option, ip_data] = ipv4_split(datagram);
+    if (ip_header == nullptr || complement_checksum(ip_header->into_slice()) != 0) {
+        cs120_warn("invalid package!");
+        return;
+    }
+
+    auto[tcp_header, tcp_option, tcp_data] = tcp_split(ip_data);
+    if (tcp_header == nullptr || complement_checksum(*ip_header, ip_data) != 0) {
+        cs120_warn("invalid package!");
+        return;
+    }
+
+    if (receive_predicted(*tcp_header, tcp_option, tcp_data, segment_size, current)) { return; }
+
+    if (!tcp_header->check_flags()) {
+        // todo
+    }
+
+    if (tcp_header->get_reset()) {
+        // todo
+    }
+
+    if (tcp_header->get_sync()) {
+        // a syn again, the ack of the handshake is lost
+        sender->generate_ack(send_queue);
+        return;
+    }
+
+    if (tcp_header->get_fin()) {
+        receiver->close(tcp_header->get_sequence() + tcp_data.size());
+    }
+
+    if (tcp_header->get_ack()) {
+        uint32_t ack_num = tcp_header->get_ack_number();
+        if (ack_num > receiver->ack_receive) {
+            receiver->ack_receive = tcp_header->get_ack_number();
         }
     }
 
-    uint32_t end = buffer_end;
+    TCPSACKBlocks blocks{};
+    uint32_t ts_echo = 0;
 
-    size_t size = 0;
+    TCPOptionIter iter{tcp_option};
+    for (auto item = iter.next(); !iter.is_end(item); item = iter.next()) {
+        auto[op, data] = item;
 
-    if (end > buffer_start) {
-        size_t len = std::min(data.size() - size, end - buffer_start);
-        data[Range{0, len}].copy_from_slice(buffer[Range{buffer_start}][Range{0, len}]);
-        size += len;
-    } else {
-        size_t len = std::min(data.size() - size, buffer.size() - buffer_start);
-        data[Range{0, len}].copy_from_slice(buffer[Range{buffer_start}][Range{0, len}]);
-        size += len;
-        if (size < buffer.size()) {
-            len = std::min(static_cast<uint32_t>(data.size() - size), end);
-            data[Range{size}][Range{0, len}].copy_from_slice(buffer[Range{0, len}]);
-            size += len;
+        if (op == TCPOption::SACK && receiver->sack) {
+            for (size_t i = 0; i + 8 <= data.size(); i += 8) {
+                blocks.push(ntohl(*reinterpret_cast<const uint32_t *>(&data[i])),
+                            ntohl(*reinterpret_cast<const uint32_t *>(&data[i + 4])));
+            }
+        } else if (op == TCPOption::Timestamp && receiver->timestamp && data.size() == 8) {
+            // RFC 7323, only a segment which is not beyond what has been acknowledged
+            // updates the timestamp to echo
+            if (!tcp_seq_before(receiver->frame_receive, tcp_header->get_sequence())) {
+                receiver->ts_recent = ntohl(*reinterpret_cast<const uint32_t *>(&data[0]));
+            }
+
+            if (tcp_header->get_ack()) {
+                ts_echo = ntohl(*reinterpret_cast<const uint32_t *>(&data[4]));
+            }
         }
     }
 
-    buffer_start = index_increase(buffer_start, size);
+    // of the segments merged by the device, see `TCPCoalescer`
+    uint16_t segments = segment_size == 0 ? 1 :
+                        divide_ceil<size_t>(tcp_data.size(), segment_size);
 
-    return size;
+    // RFC 5681, out of order data and data filling a hole are acknowledged at once, RFC 1122,
+    // so is data of more than one segment
+    uint16_t immediate = tcp_header->get_fin() || segments > 1 ? 1 : 0;
+
+    if (!tcp_data.empty()) {
+        uint32_t expected = receiver->frame_receive;
+        receiver->accept(tcp_header->get_sequence(), tcp_data);
+
+        if (tcp_header->get_sequence() != expected) {
+            immediate = segments;
+        } else if (receiver->frame_receive != expected + tcp_data.size()) {
+            immediate = 1;
+        }
+    }
+
+    // the window of a segment with syn is never scaled
+    uint32_t window = tcp_header->get_window() << (tcp_header->get_sync() ? 0 : receiver->scale);
+
+    if (!tcp_data.empty() || tcp_header->get_fin()) {
+        handle(Request{Request::FrameReceive, {.frame_receive = {
+                receiver->ack_receive, window,
+                receiver->frame_receive, static_cast<uint32_t>(receiver->get_window()),
+                receiver->get_sack(), blocks, receiver->ts_recent, ts_echo, immediate,
+        }}}, current);
+    } else if (tcp_header->get_ack()) {
+        handle(Request{Request::AckReceive, {.ack_receive = {
+                tcp_header->get_ack_number(), window, blocks,
+                receiver->ts_recent, ts_echo,
+        }}}, current);
+    }
+
+    // the next segment of a bulk transfer has the same window, nothing but ack, and timestamps
+    // as the only option
+    uint16_t next_window = tcp_header->get_window();
+    size_t next_length = sizeof(TCPHeader) + (receiver->timestamp ? sizeof(TCPOptionTime) : 0);
+
+    prediction[0] = static_cast<uint8_t>(next_length / 4 << 4);
+    prediction[1] = TCPHeader::FLAGS_ACK;
+    prediction[2] = static_cast<uint8_t>(next_window >> 8);
+    prediction[3] = static_cast<uint8_t>(next_window);
 }
 
-void *TCPClient::tcp_sender(void *args_) {
-    using namespace std::literals;
-    using TimePoint = std::chrono::time_point<std::chrono::system_clock>;
+bool TCPConnection::receive_predicted(const TCPHeader &tcp_header, Slice<uint8_t> tcp_option,
+                                      Slice<uint8_t> tcp_data, uint16_t segment_size,
+                                      TimePoint current) {
+    uint8_t word[4];
+    memcpy(word, reinterpret_cast<const uint8_t *>(&tcp_header) + 12, sizeof(word));
+    word[1] &= ~TCPHeader::FLAGS_PUSH;
 
-    auto *args = reinterpret_cast<TCPSendArgs *>(args_);
-    auto sender = args->connection;
+    if (memcmp(word, prediction, sizeof(word)) != 0 ||
+        tcp_header.get_sequence() != receiver->frame_receive || !receiver->fragments.empty() ||
+        receiver->closed || tcp_data.size() > receiver->get_window()) { return false; }
 
-    uint32_t congestion_threshold = sender->remote_window / sender->mss * sender->mss;
-    uint32_t congestion_window = sender->mss;
-    uint32_t transmitting = 0;
-    uint32_t transmitted = 0;
+    uint32_t ts_echo = 0;
 
-    uint32_t last_ack_num = 0;
-    uint32_t last_ack_count = 0;
+    if (receiver->timestamp) {
+        // only in the layout of RFC 7323 appendix A
+        TCPOptionTime layout{0, 0};
+        if (memcmp(tcp_option.begin(), layout.into_slice().begin(), 4) != 0) { return false; }
 
-    std::list<std::pair<TimePoint, uint32_t>> timeout{};
+        auto *option = reinterpret_cast<const TCPOptionTime *>(tcp_option.begin());
+        receiver->ts_recent = option->get_time_value();
+        ts_echo = option->get_time_reply();
+    }
 
-    for (;;) {
-        if (args->send_queue.is_closed()) { break; }
+    if (tcp_seq_before(receiver->ack_receive, tcp_header.get_ack_number())) {
+        receiver->ack_receive = tcp_header.get_ack_number();
+    }
 
-        auto recv = timeout.empty() ? args->request_receiver.recv_timeout(300ms).unwrap() :
-                    args->request_receiver.recv_deadline(timeout.begin()->first).unwrap();
+    uint32_t window = tcp_header.get_window() << receiver->scale;
 
-        auto current = std::chrono::system_clock::now();
+    if (tcp_data.empty()) {
+        handle(Request{Request::AckReceive, {.ack_receive = {
+                tcp_header.get_ack_number(), window, TCPSACKBlocks{},
+                receiver->ts_recent, ts_echo,
+        }}}, current);
 
-        if (recv.none()) {
-            if (sender->finished()) { break; }
+        return true;
+    }
 
-            if (!timeout.empty() && current > timeout.begin()->first) {
-                // this is timeout
-                timeout.begin()->first += 300ms;
+    // next in order with room for it, straight into the buffer
+    receiver->buffer.write_at(0, tcp_data);
+    receiver->frame_receive += tcp_data.size();
+    receiver->buffer.commit(tcp_data.size());
 
-                // multiplicative decreasing
-                congestion_threshold = congestion_threshold / sender->mss / 2 * sender->mss;
-                if (congestion_threshold < sender->mss) {
-                    congestion_threshold = sender->mss;
-                }
+    // as in `receive`, data coalesced from more than one segment is acknowledged at once
+    uint16_t immediate = segment_size != 0 && tcp_data.size() > segment_size ? 1 : 0;
 
-                congestion_window = sender->mss;
+    // the predicted header has room for no sack option
+    handle(Request{Request::FrameReceive, {.frame_receive = {
+            receiver->ack_receive, window,
+            receiver->frame_receive, static_cast<uint32_t>(receiver->get_window()),
+            TCPSACKBlocks{}, TCPSACKBlocks{}, receiver->ts_recent, ts_echo, immediate,
+    }}}, current);
 
-                uint32_t size = timeout.begin()->second;
-                size = std::min(size, congestion_window);
+    return true;
+}
 
-                sender->generate_data(args->send_queue, 0, size);
-            } else {
-                continue;
+void TCPConnection::handle(const Request &request, TimePoint current) {
+    size_t ack_size = 0;
+    uint32_t ts_echo = 0;
+
+    switch (request.type) {
+        case Request::FrameReceive: {
+            auto &inner = request.inner.frame_receive;
+
+            ack_size = sender->ack_update(inner.ack_receive);
+            sender->remote_window = inner.remote_window;
+            sender->frame_receive = inner.frame_receive;
+            sender->local_window = inner.local_window;
+            sender->sack_blocks = inner.sack;
+            if (sender->sack) { sender->sack_update(inner.remote_sack); }
+            sender->ts_recent = inner.ts_recent;
+            ts_echo = inner.ts_echo;
+
+            // RFC 1122, acknowledge every second segment or after a delay,
+            // unless data leaving in the meantime carries the ack
+            if (sender->ack_delayed++ == 0) { ack_deadline = current + TCPSender::ACK_DELAY; }
+
+            // one duplicate ack for every out of order segment, to trigger fast retransmit
+            for (uint16_t i = 0; i < inner.immediate; ++i) { sender->generate_ack(send_queue); }
+        }
+            break;
+        case Request::AckReceive: {
+            auto &inner = request.inner.ack_receive;
+
+            ack_size = sender->ack_update(inner.ack_receive);
+            sender->remote_window = inner.remote_window;
+            if (sender->sack) { sender->sack_update(inner.sack); }
+            sender->ts_recent = inner.ts_recent;
+            ts_echo = inner.ts_echo;
+
+            // a pure ack which acknowledges nothing while data is outstanding
+            if (ack_size == 0 && transmitting > 0 && inner.ack_receive == sender->ack_receive) {
+                last_ack_count += 1;
+            }
+        }
+            break;
+        case Request::FrameSend:
+            break;
+        case Request::Cork:
+            sender->cork = request.inner.cork.value;
+            break;
+        case Request::NoDelay:
+            sender->nodelay = request.inner.nodelay.value;
+            break;
+        case Request::Close:
+            if (!sender->closed) {
+                sender->closed = true;
+                sender->close_seq = sender->ack_receive + sender->get_size();
             }
-        } else {
-            size_t ack_size = 0;
 
-            switch (recv->type) {
-                case Request::FrameReceive: {
-                    auto &request = recv->inner.frame_receive;
+            break;
+        default:
+            cs120_abort("unknown type!");
+    }
 
-                    if (last_ack_count > 0 && last_ack_num == request.ack_receive) {
-                        last_ack_count += 1;
-                    }
+    // after going back n, the ack of an earlier transmission may cover more than is in flight
+    ack_size = std::min<size_t>(ack_size, transmitting);
+    transmitting -= ack_size;
 
-                    ack_size = sender->ack_update(request.ack_receive);
-                    sender->remote_window = sender->remote_window;
-                    sender->frame_receive = request.frame_receive;
-                    sender->local_window = request.local_window;
+    uint32_t acked = ack_size;
+    if (acked > 0) { last_ack_count = 0; }
 
-                    sender->generate_ack(args->send_queue);
-                }
-                    break;
-                case Request::AckReceive: {
-                    auto &request = recv->inner.ack_receive;
+    TCPRetransmissionTimer::Duration rtt{0};
 
-                    if (last_ack_count > 0 && last_ack_num == request.ack_receive) {
-                        last_ack_count += 1;
-                    }
+    if (acked > 0 && sender->timestamp && ts_echo != 0) {
+        rtt = std::chrono::milliseconds{tcp_timestamp() - ts_echo};
+        timer.sample(rtt);
+    } else if (acked > 0 && timing && !tcp_seq_before(sender->ack_receive, timing_seq)) {
+        rtt = std::chrono::duration_cast<TCPRetransmissionTimer::Duration>(current - timing_start);
+        timer.sample(rtt);
+        timing = false;
+    }
 
-                    ack_size = sender->ack_update(request.ack_receive);
-                    sender->remote_window = sender->remote_window;
-                }
-                    break;
-                case Request::FrameSend:
-                    break;
-                case Request::Close:
-                    if (!sender->closed) {
-                        sender->closed = true;
-                        sender->close_seq = sender->ack_receive + sender->get_size();
-                    }
-
-                    break;
-                default:
-                    cs120_abort("unknown type!");
-            }
+    while (ack_size > 0) {
+        auto ptr = timeout.begin();
 
-            transmitting -= ack_size;
-            transmitted += ack_size;
+        if (ptr->second <= ack_size) {
+            ack_size -= ptr->second;
+            timeout.pop_front();
+        } else {
+            ptr->second -= ack_size;
+            ack_size = 0;
+        }
+    }
 
-            while (ack_size > 0) {
-                auto ptr = timeout.begin();
+    // RFC 6298, restart the timer when new data is acknowledged
+    if (acked > 0 && !timeout.empty()) { timeout.begin()->first = current + timer.get_rto(); }
+
+    if (recovery) {
+        if (acked > 0 && tcp_seq_before(recover, sender->ack_receive)) {
+            // full acknowledgement, deflate the window
+            recovery = false;
+            inflation = 0;
+        } else if (acked > 0) {
+            // partial acknowledgement, the next hole is lost as well
+            if (!sender->sack || !tcp_seq_before(sender->ack_receive, retransmit_next)) {
+                sender->generate_data(send_queue, 0,
+                                      std::min<uint32_t>(sender->mss, transmitting));
+            }
 
-                if (ptr->second <= ack_size) {
-                    ack_size -= ptr->second;
-                    timeout.pop_front();
-                } else {
-                    ptr->second -= ack_size;
-                    ack_size = 0;
+            if (sender->sack) {
+                if (tcp_seq_before(retransmit_next, sender->ack_receive)) {
+                    retransmit_next = sender->ack_receive;
                 }
+
+                retransmit_next = sender->generate_holes(send_queue, retransmit_next,
+                                                         sender->sack_high());
             }
 
-            if (transmitted >= congestion_window) {
-                transmitted -= congestion_window;
+            if (!timeout.empty()) { timeout.begin()->first = current + timer.get_rto(); }
+            timing = false;
 
-                if (congestion_window == congestion_threshold) {
-                    // additive increasing
-                    congestion_window += sender->mss;
-                    congestion_threshold += sender->mss;
-                } else {
-                    // slow start
-                    congestion_window *= 2;
+            inflation -= std::min(inflation, acked);
+            if (acked >= sender->mss) { inflation += sender->mss; }
+        } else if (last_ack_count > 3) {
+            // every further duplicate ack means a segment has left the network
+            inflation += sender->mss;
 
-                    if (congestion_window > congestion_threshold) {
-                        congestion_window = congestion_threshold;
-                    }
-                }
+            if (sender->sack) {
+                retransmit_next = sender->generate_holes(send_queue, retransmit_next,
+                                                         sender->sack_high());
             }
+        }
+    } else if (last_ack_count == 3 && tcp_seq_before(recover, sender->ack_receive)) {
+        // fast retransmit
+        congestion->on_loss(transmitting);
+        inflation = 3u * sender->mss;
+        recover = sender->frame_send - 1;
+        recovery = true;
+
+        if (sender->sack && !sender->scoreboard.empty()) {
+            // only resend what the remote has not reported
+            retransmit_next = sender->generate_holes(send_queue, sender->ack_receive,
+                                                     sender->sack_high());
+        } else {
+            sender->generate_data(send_queue, 0, std::min<uint32_t>(sender->mss, transmitting));
+            retransmit_next = sender->ack_receive + std::min<uint32_t>(sender->mss, transmitting);
+        }
 
-            if (last_ack_count >= 3) {
-                // todo
-            }
+        if (!timeout.empty()) { timeout.begin()->first = current + timer.get_rto(); }
+        timing = false;
+    } else if (acked > 0) {
+        congestion->on_ack(acked, transmitting, rtt);
+    }
+}
 
-            uint32_t size = sender->get_size();
-            size = std::min(size, sender->get_send_window());
-            size = std::min(size, congestion_window);
+void TCPConnection::retransmit(TimePoint current) {
+    timer.backoff();
+    timing = false;
 
-            if (size > transmitting) {
-                sender->generate_data(args->send_queue, transmitting, size);
+    // the segment may have been dropped for exceeding the path mtu
+    uint16_t path_mtu = IPV4PathMTUCache::get().query(sender->remote.ip_addr, mtu);
+    sender->mss = std::min<uint16_t>(sender->mss, TCPHeader::max_payload(path_mtu));
 
-                timeout.emplace_back(std::make_pair(current + 300ms, size - transmitting));
-                transmitting = size;
-            }
+    congestion->set_mss(sender->mss);
+    congestion->on_rto(transmitting);
+
+    recovery = false;
+    inflation = 0;
+    recover = sender->frame_send - 1;
+    last_ack_count = 0;
+
+    // the remote is allowed to renege on what it has reported
+    sender->scoreboard.clear();
+
+    // go back n, what follows is sent again as the window opens
+    uint32_t size = std::min(transmitting, congestion->get_window());
+
+    sender->generate_data(send_queue, 0, size);
+
+    timeout.clear();
+    timeout.emplace_back(current + timer.get_rto(), size);
+    transmitting = size;
+}
+
+void TCPConnection::transmit(TimePoint current) {
+    uint32_t size = sender->get_size();
+    size = std::min(size, sender->get_send_window());
+    size = std::min(size, congestion->get_window() + inflation);
+    size = sender->nagle(transmitting, size);
+
+    uint64_t rate = congestion->pacing_rate();
+    paced = false;
+
+    if (size > transmitting && rate != 0) {
+        if (current < pace_next) {
+            // too early, come back when the pacing allows
+            size = transmitting;
+            paced = true;
+        } else {
+            // release about a millisecond worth of data at once
+            uint32_t quantum = std::max<uint64_t>(sender->mss, rate / 1000);
+            size = std::min(size, transmitting + quantum);
+
+            pace_next = current + std::chrono::microseconds{
+                    (size - transmitting) * 1000000ull / rate};
+            paced = size < sender->get_size();
         }
     }
 
-    delete args;
+    if (size > transmitting) {
+        congestion->on_send(transmitting);
+        sender->generate_data(send_queue, transmitting, size);
 
-    return nullptr;
+        if (!timing) {
+            timing = true;
+            timing_seq = sender->ack_receive + size;
+            timing_start = current;
+        }
+
+        timeout.emplace_back(current + timer.get_rto(), size - transmitting);
+        transmitting = size;
+    }
+
+    if (sender->ack_delayed >= 2 || (sender->ack_delayed > 0 && current >= ack_deadline)) {
+        sender->generate_ack(send_queue);
+    }
 }
 
-void TCPReceiver::close(uint32_t seq) {
-    close_seq = seq;
-    if (frame_receive == close_seq) { ++frame_receive; }
-    closed = true;
-    empty.notify_all();
+void TCPConnection::finish() {
+    std::unique_lock<std::mutex> guard{lock};
+    state = State::Finished;
+
+    // a connection gone before the handshake completes must not be waited for either
+    established.notify_all();
+    if (waker != nullptr) { waker->wake(token); }
+
+    // the application must not block on a connection nobody drives any more
+    if (sender != nullptr) { sender->buffer.close(); }
+    if (receiver != nullptr) { receiver->buffer.close(); }
 }
 
-void *TCPClient::tcp_receiver(void *args_) {
-    using namespace std::literals;
+void TCPConnection::set_waker(std::shared_ptr<Waker> value, size_t value_token) {
+    std::unique_lock<std::mutex> guard{lock};
+    waker = std::move(value);
+    token = value_token;
 
-    auto *args = reinterpret_cast<TCPRecvArgs *>(args_);
-    auto receiver = args->connection;
+    if (sender != nullptr) {
+        sender->buffer.set_waker(waker, token);
+        receiver->buffer.set_waker(waker, token);
+    } else if (waker != nullptr) {
+        waker->wake(token);
+    }
+}
 
-    for (;;) {
-        auto buffer = args->recv_queue->recv();
+TCPConnection::TimePoint TCPConnection::poll(TimePoint current) {
+    if (state == State::Finished) { return TimePoint::max(); }
 
-        auto[ip_header, ip_option, ip_data] = ipv4_split((*buffer)[Range{}]);
-        if (ip_header == nullptr || complement_checksum(ip_header->into_slice()) != 0) {
-            cs120_warn("invalid package!");
-            continue;
-        }
+    if (send_queue.is_closed()) {
+        finish();
+        return TimePoint::max();
+    }
 
-        auto[tcp_header, tcp_option, tcp_data] = tcp_split(ip_data);
-        if (tcp_header == nullptr || complement_checksum(*ip_header, ip_data) != 0) {
-            cs120_warn("invalid package!");
-            continue;
-        }
+    if (state == State::Closed) {
+        state = State::SyncSent;
+        sync_start = current;
+        sync_deadline = current + timer.get_rto();
 
-        if (!tcp_header->check_flags()) {
-            // todo
-        }
+        generate_sync();
+    }
 
-        if (tcp_header->get_reset()) {
-            // todo
-        }
+    if (state == State::SyncSent || state == State::SyncReceived) {
+        for (;;) {
+            auto buffer = recv_queue->try_recv();
+            if (buffer.none()) { break; }
 
-        if (tcp_header->get_sync()) {
-            // todo
+            handshake((*buffer)[Range{}], current);
+            if (state == State::Established) { break; }
         }
 
-        if (tcp_header->get_fin()) {
-            receiver->close(tcp_header->get_sequence() + tcp_data.size());
-        }
+        if (state != State::Established) {
+            if (current < sync_deadline) { return sync_deadline; }
 
-        if (tcp_header->get_ack()) {
-            uint32_t ack_num = tcp_header->get_ack_number();
-            if (ack_num > receiver->ack_receive) {
-                receiver->ack_receive = tcp_header->get_ack_number();
+            // no one waits for a passive open that never completes
+            if (passive && ++sync_retries > PASSIVE_SYNC_RETRIES) {
+                finish();
+                return TimePoint::max();
             }
+
+            // the syn is retransmitted with backoff, and timed unless retransmitted
+            timer.backoff();
+            retransmitted = true;
+            sync_deadline = current + timer.get_rto();
+
+            option.time = TCPOptionTime{tcp_timestamp(), 0};
+            generate_sync();
+
+            return sync_deadline;
         }
+    }
+
+    for (;;) {
+        auto buffer = recv_queue->try_recv();
+        if (buffer.none()) { break; }
+
+        receive((*buffer)[Range{}], buffer->segment_size, current);
+    }
+
+    for (;;) {
+        auto request = request_receiver.try_recv();
+        if (request.none()) { break; }
+
+        handle(*request, current);
+    }
+
+    if (!timeout.empty() && current > timeout.begin()->first) { retransmit(current); }
+
+    if (sender->finished()) {
+        finish();
+        return TimePoint::max();
+    }
+
+    transmit(current);
+
+    TimePoint deadline = timeout.empty() ? TimePoint::max() : timeout.begin()->first;
+    if (paced) { deadline = std::min(deadline, pace_next); }
+    if (sender->ack_delayed > 0) { deadline = std::min(deadline, ack_deadline); }
+
+    return deadline;
+}
+
+std::pair<std::shared_ptr<TCPSender>, std::shared_ptr<TCPReceiver>>
+TCPConnection::wait_established() {
+    std::unique_lock<std::mutex> guard{lock};
+
+    while (is_connecting()) { established.wait(guard); }
+
+    return std::make_pair(sender, receiver);
+}
+
+void TCPConnection::accept_sync(Slice<uint8_t> datagram, TimePoint current) {
+    passive = true;
+    state = State::SyncReceived;
+    sync_start = current;
+    sync_deadline = current + timer.get_rto();
+
+    // records the options of the remote and answers with the syn ack
+    handshake(datagram, current);
+}
+
+void TCPConnection::accept_cookie(Slice<uint8_t> datagram, uint16_t segment_size,
+                                  TimePoint current, TCPSyncCookie::Option cookie) {
+    auto[ip_header, ip_option, ip_data] = ipv4_split(datagram);
+    auto[tcp_header, tcp_option, tcp_data] = tcp_split(ip_data);
+
+    passive = true;
+    sync = true;
+    ack = true;
+
+    // as the syn ack made from the cookie has told the remote
+    remote_mss = cookie.mss;
+    scale = cookie.scale != TCPSyncCookie::NO_SCALE;
+    remote_scale = scale ? std::min(cookie.scale, TCPOptionScale::MAX_SCALE) : 0;
+    if (!scale) { local_scale = 0; }
+    sack = cookie.sack;
+
+    local_seq = tcp_header->get_ack_number();
+    remote_seq = tcp_header->get_sequence();
+    remote_window = tcp_header->get_window() << remote_scale;
+
+    establish();
+
+    // the data of the ack would otherwise wait for a retransmission
+    if (!tcp_data.empty()) { receive(datagram, segment_size, current); }
+}
+
+
+TCPEngine::TCPEngine(size_t count) : workers{}, next_worker{0}, next_token{0} {
+    for (size_t i = 0; i < count; ++i) {
+        workers.emplace_back(new Worker{{}, std::make_shared<Waker>(), {}, {}});
+    }
+
+    for (auto &worker: workers) {
+        pthread_create(&worker->thread, nullptr, tcp_worker,
+                       new WorkerArgs{.engine = this, .worker = worker.get()});
+    }
+}
+
+void TCPEngine::add(std::shared_ptr<TCPTask> task) {
+    auto &worker = workers[next_worker.fetch_add(1) % workers.size()];
+
+    {
+        std::unique_lock<std::mutex> guard{worker->lock};
+        worker->pending.emplace_back(std::move(task));
+    }
+
+    // token 0 is never a task, it only asks the worker to look at `pending`
+    worker->waker->wake(0);
+}
+
+void *TCPEngine::tcp_worker(void *args_) {
+    auto *args = reinterpret_cast<WorkerArgs *>(args_);
+    auto *engine = args->engine;
+    auto *worker = args->worker;
+
+    std::unordered_map<size_t, std::shared_ptr<TCPTask>> tasks{};
+
+    // one timer per task, for a connection shared by its retransmission, delayed ack and
+    // pacing deadlines
+    TimingWheel<size_t> timers{};
 
-        if (!tcp_data.empty()) {
-            receiver->accept(tcp_header->get_sequence(), tcp_data);
+    auto poll = [&](size_t token, TimePoint current) {
+        auto ptr = tasks.find(token);
+        if (ptr == tasks.end()) { return; }
+
+        TimePoint deadline = ptr->second->poll(current);
+
+        if (ptr->second->is_finished()) {
+            timers.cancel(token);
+            tasks.erase(ptr);
+        } else if (deadline != TimePoint::max()) {
+            timers.schedule(token, deadline);
+        } else {
+            timers.cancel(token);
         }
+    };
+
+    for (;;) {
+        TimePoint deadline = std::min(timers.next_deadline(),
+                                      Clock::now() + std::chrono::seconds{1});
+
+        auto tokens = worker->waker->wait_until(deadline);
 
-        uint32_t remote_window = tcp_header->get_window() << receiver->scale;
-        uint32_t local_window = receiver->get_window();
-
-        if (!tcp_data.empty() || tcp_header->get_fin()) {
-            auto send = args->request_sender.send();
-            if (send.none()) { break; }
-            *send = Request{Request::FrameReceive, {.frame_receive = {
-                    receiver->ack_receive, remote_window,
-                    receiver->frame_receive, local_window,
-            }}};
-        } else if (tcp_header->get_ack()) {
-            auto send = args->request_sender.send();
-            if (send.none()) { break; }
-            *send = Request{Request::AckReceive, {.ack_receive = {
-                    receiver->ack_receive, remote_window,
-            }}};
+        auto current = Clock::now();
+
+        if (tokens.count(0) != 0) {
+            std::vector<std::shared_ptr<TCPTask>> pending{};
+
+            {
+                std::unique_lock<std::mutex> guard{worker->lock};
+                pending.swap(worker->pending);
+            }
+
+            for (auto &task: pending) {
+                size_t token = engine->next_token.fetch_add(1) + 1;
+
+                task->attach(worker->waker, token);
+                tasks.emplace(token, std::move(task));
+                tokens.emplace(token);
+            }
+
+            tokens.erase(0);
         }
+
+        timers.advance(current, [&](size_t token) { tokens.emplace(token); });
+
+        for (auto token: tokens) { poll(token, current); }
     }
 
     delete args;
@@ -395,17 +997,80 @@ void *TCPClient::tcp_receiver(void *args_) {
 }
 
 
+void TCPClient::open(std::shared_ptr<BaseSocket> &device, size_t size,
+                     EndPoint local, EndPoint remote, size_t send_size, size_t receive_size,
+                     TCPCongestionAlgorithm congestion, TCPEngine &engine) {
+    auto[request_send, request_recv] = MPSCQueue<Request>::channel(size);
+
+    this->device = device;
+    request_sender = std::move(request_send);
+
+    connection = std::make_shared<TCPConnection>(
+            device, size, local, remote, send_size, receive_size, congestion,
+            std::move(request_recv)
+    );
+
+    engine.add(connection);
+}
+
+bool TCPClient::establish(bool block) {
+    if (!block && connection->is_connecting()) { return false; }
+
+    std::tie(sender, receiver) = connection->wait_established();
+    return sender != nullptr;
+}
+
 TCPClient::TCPClient(std::shared_ptr<BaseSocket> &device, size_t size,
-                     EndPoint local, EndPoint remote) :
-        send_thread{}, recv_thread{}, device{device},
-        sender{nullptr}, receiver{nullptr}, request_sender{} {
-    auto[send, recv] = device->bind([=](auto ip_header, auto ip_option, auto ip_data) {
+                     EndPoint local, EndPoint remote, size_t send_size, size_t receive_size,
+                     TCPCongestionAlgorithm congestion, TCPEngine &engine) :
+        device{}, connection{nullptr}, sender{nullptr}, receiver{nullptr}, request_sender{} {
+    open(device, size, local, remote, send_size, receive_size, congestion, engine);
+    establish(true);
+}
+
+TCPClient TCPClient::connect(std::shared_ptr<BaseSocket> &device, size_t size,
+                             EndPoint local, EndPoint remote, size_t send_size,
+                             size_t receive_size, TCPCongestionAlgorithm congestion,
+                             TCPEngine &engine) {
+    TCPClient client{};
+    client.open(device, size, local, remote, send_size, receive_size, congestion, engine);
+    return client;
+}
+
+bool TCPClient::is_connecting() { return !ready(false) && connection->is_connecting(); }
+
+void TCPClient::set_waker(std::shared_ptr<Waker> waker, size_t token) {
+    connection->set_waker(std::move(waker), token);
+}
+
+TCPClient::TCPClient(std::shared_ptr<BaseSocket> device, std::shared_ptr<TCPConnection> connection,
+                     MPSCQueue<TCPClient::Request>::Sender &&requests) :
+        device{std::move(device)}, connection{std::move(connection)}, sender{nullptr},
+        receiver{nullptr}, request_sender{std::move(requests)} {
+    // no longer reported to the acceptor
+    this->connection->set_waker(nullptr, 0);
+    establish(true);
+}
+
+
+TCPAcceptor::TCPAcceptor(std::shared_ptr<BaseSocket> &device, size_t size, EndPoint local,
+                         size_t sync_backlog, size_t accept_backlog, size_t send_size,
+                         size_t receive_size, TCPCongestionAlgorithm algorithm,
+                         TCPEngine &engine) :
+        device{device}, size{size}, local{local}, sync_backlog{sync_backlog},
+        accept_backlog{accept_backlog}, send_size{send_size}, receive_size{receive_size},
+        algorithm{algorithm}, engine{engine}, cookie{std::make_shared<TCPSyncCookie>()},
+        cookie_sent{std::make_shared<std::atomic<TimePoint>>(TimePoint{})}, send_queue{},
+        recv_queue{}, worker_waker{nullptr}, worker_token{0}, syncing{}, held{0}, remotes{},
+        sweep_size{0}, lock{}, ready{}, accepted{}, closed{false}, finished{false},
+        waker{nullptr}, token{0} {
+    // the first segment of a handshake, the rest goes to the connection it creates
+    auto[send, recv] = device->bind([local, cookie = cookie, cookie_sent = cookie_sent](
+            auto ip_header, auto ip_option, auto ip_data) {
         (void) ip_option;
-        (void) ip_data;
 
         if (ip_header->get_protocol() != IPV4Protocol::TCP ||
-            ip_header->get_dest_ip() != local.ip_addr ||
-            ip_header->get_src_ip() != remote.ip_addr) { return false; }
+            ip_header->get_dest_ip() != local.ip_addr) { return false; }
 
         auto[tcp_header, tcp_option, tcp_data] = tcp_split(ip_data);
         if (tcp_header == nullptr) {
@@ -413,168 +1078,296 @@ TCPClient::TCPClient(std::shared_ptr<BaseSocket> &device, size_t size,
             return false;
         }
 
-        if (tcp_header->get_dest_port() != local.port ||
-            tcp_header->get_src_port() != remote.port) { return false; }
+        if (tcp_header->get_dest_port() != local.port) { return false; }
+        if (tcp_header->get_sync()) { return !tcp_header->get_ack(); }
 
-        return true;
+        // or the ack of a syn cookie, segments of established connections fail the hash
+        auto current = Clock::now();
+        if (!tcp_header->get_ack() || tcp_header->get_reset() ||
+            current - cookie_sent->load() > 2 * TCPSyncCookie::PERIOD) { return false; }
+
+        TCPSyncCookie::Option option{};
+        return cookie->decode(local, EndPoint{ip_header->get_src_ip(), tcp_header->get_src_port()},
+                              tcp_header->get_sequence() - 1, tcp_header->get_ack_number() - 1,
+                              current, option);
     }, size);
 
-    uint16_t local_mss = TCPHeader::max_payload(device->get_mtu());
-    uint16_t remote_mss = 0;
+    send_queue = std::move(send);
+    recv_queue = std::move(recv);
+}
 
-    uint8_t local_scale = 0;
-    uint8_t remote_scale = 0;
+void TCPAcceptor::attach(const std::shared_ptr<Waker> &value, size_t value_token) {
+    recv_queue->set_waker(value, value_token);
 
-    uint32_t local_seq = 0;
-    uint32_t remote_seq = 0; // todo
+    std::unique_lock<std::mutex> guard{lock};
+    worker_waker = value;
+    worker_token = value_token;
+}
 
-    SyncOption option{static_cast<uint16_t>(TCPHeader::max_payload(1500)), local_scale};
+void TCPAcceptor::accept(Slice<uint8_t> datagram, uint16_t segment_size, TimePoint current) {
+    auto[ip_header, ip_option, ip_data] = ipv4_split(datagram);
+    if (ip_header == nullptr || complement_checksum(ip_header->into_slice()) != 0) {
+        cs120_warn("invalid package!");
+        return;
+    }
+
+    auto[tcp_header, tcp_option, tcp_data] = tcp_split(ip_data);
+    if (tcp_header == nullptr || complement_checksum(*ip_header, ip_data) != 0) {
+        cs120_warn("invalid package!");
+        return;
+    }
 
-    uint32_t local_window = TCPSender::BUFFER_SIZE - 1;
-    uint32_t remote_window = 0;
+    EndPoint remote{ip_header->get_src_ip(), tcp_header->get_src_port()};
+    uint64_t key = (static_cast<uint64_t>(remote.ip_addr) << 16) | remote.port;
 
-    uint16_t window = std::min<size_t>(local_window >> local_scale,
-                                       std::numeric_limits<uint16_t>::max());
+    // a retransmitted syn, or a segment after the ack of a cookie, is for the connection
+    // already created
+    auto ptr = remotes.find(key);
+    if (ptr != remotes.end() && !ptr->second.expired()) { return; }
 
     {
-        auto buffer = send.send();
-        TCPHeader::generate((*buffer)[Range{}], 0, IDENTIFIER, local.ip_addr, remote.ip_addr, 64,
-                            local.port, remote.port, local_seq, 0,
-                            false, false, false, false, false, false, false, true, false,
-                            window, option.into_slice(), 0);
+        std::unique_lock<std::mutex> guard{lock};
+        if (accepted.size() + held >= accept_backlog) {
+            // the remote retransmits its syn, or its data after the ack of a cookie, by then
+            // there may be room
+            cs120_warn("backlog full!");
+            return;
+        }
     }
 
-    bool sync = false, ack = false;
+    TCPSyncCookie::Option option{};
 
-    for (;;) {
-        using namespace std::literals;
+    if (tcp_header->get_sync()) {
+        if (syncing.size() >= sync_backlog) {
+            send_cookie(remote, *tcp_header, tcp_option, current);
+            return;
+        }
+    } else if (!cookie->decode(local, remote, tcp_header->get_sequence() - 1,
+                               tcp_header->get_ack_number() - 1, current, option)) {
+        return;
+    }
 
-        auto buffer = recv->recv_timeout(300ms).unwrap();
-        if (buffer.none()) {
-            auto send_buffer = send.send();
-            TCPHeader::generate((*send_buffer)[Range{}], 0, IDENTIFIER,
-                                local.ip_addr, remote.ip_addr, 64,
-                                local.port, remote.port, local_seq, 0,
-                                false, false, false, false, false, false, false, true, false,
-                                window, option.into_slice(), 0);
+    auto[request_send, request_recv] = MPSCQueue<TCPClient::Request>::channel(size);
 
-            continue;
-        }
+    auto connection = std::make_shared<TCPConnection>(
+            device, size, local, remote, send_size, receive_size, algorithm,
+            std::move(request_recv)
+    );
 
-        auto[ip_header, ip_option, ip_data] = ipv4_split((*buffer)[Range{}]);
-        if (ip_header == nullptr || complement_checksum(ip_header->into_slice()) != 0) {
-            cs120_warn("invalid package!");
-            continue;
-        }
+    if (tcp_header->get_sync()) {
+        connection->accept_sync(datagram, current);
+    } else {
+        connection->accept_cookie(datagram, segment_size, current, option);
+    }
 
-        auto[tcp_header, tcp_option, tcp_data] = tcp_split(ip_data);
-        if (tcp_header == nullptr || complement_checksum(*ip_header, ip_data) != 0) {
-            cs120_warn("invalid package!");
-            continue;
-        }
+    connection->set_waker(worker_waker, worker_token);
 
-        remote_window = tcp_header->get_window() << remote_scale;
+    // the ack of a cookie completes the handshake at once
+    if (!tcp_header->get_sync()) { ++held; }
 
-        if (!tcp_header->check_flags()) {
-            // todo
-        }
+    remotes[key] = connection;
+    syncing.push_back(Entry{connection, std::move(request_send)});
 
-        if (tcp_header->get_fin()) {
-            // todo
-        }
+    engine.add(std::move(connection));
+}
 
-        if (tcp_header->get_reset()) {
-            // todo≤
+void TCPAcceptor::send_cookie(EndPoint remote, const TCPHeader &tcp_header,
+                              Slice<uint8_t> tcp_option, TimePoint current) {
+    TCPSyncCookie::Option option{TCPOptionMSS::DEFAULT, TCPSyncCookie::NO_SCALE, false};
+
+    TCPOptionIter iter{tcp_option};
+    for (auto item = iter.next(); !iter.is_end(item); item = iter.next()) {
+        auto[op, data] = item;
+
+        switch (op) {
+            case TCPOption::MaximumSegmentSize:
+                option.mss = (static_cast<uint16_t>(data[0]) << 8) |
+                             (static_cast<uint16_t>(data[1]) << 0);
+                break;
+            case TCPOption::WindowScaleFactor:
+                option.scale = std::min(data[0], TCPOptionScale::MAX_SCALE);
+                break;
+            case TCPOption::SACKPermitted:
+                option.sack = true;
+                break;
+            default:
+                break;
         }
+    }
 
-        if (tcp_header->get_ack()) {
-            if (ack) {
-                if (local_seq + 1 != tcp_header->get_ack_number()) {
-                    // todo
-                }
-            } else {
-                ack = true;
-                local_seq = tcp_header->get_ack_number();
-            }
-        }
+    uint32_t isn = cookie->encode(local, remote, tcp_header.get_sequence(), option, current);
+    cookie_sent->store(current);
 
-        if (tcp_header->get_sync()) {
-            if (sync) {
-                if (remote_seq != tcp_header->get_sequence() + 1) {
-                    // todo
-                }
-            } else {
-                sync = true;
-                remote_seq = tcp_header->get_sequence() + 1;
-            }
+    // the timestamp option has no room in the cookie and is not offered
+    uint16_t mss = TCPHeader::max_payload(
+            IPV4PathMTUCache::get().query(remote.ip_addr, device->get_mtu()));
 
-            auto send_buffer = send.send();
-            TCPHeader::generate((*send_buffer)[Range{}], 0, IDENTIFIER,
-                                local.ip_addr, remote.ip_addr, 64,
-                                local.port, remote.port, local_seq, remote_seq,
-                                false, false, false, false, true, false, false, false, false,
-                                local_window, Slice<uint8_t>{}, 0);
+    TCPSegmentOption sync_option{};
+    sync_option.push(TCPOptionMSS{mss}.into_slice());
+    if (option.scale != TCPSyncCookie::NO_SCALE) {
+        sync_option.push(TCPOptionScale{tcp_window_scale(receive_size)}.into_slice());
+    }
+    if (option.sack) { sync_option.push(TCPOptionSACKPermitted{}.into_slice()); }
+
+    auto buffer = send_queue.try_send().unwrap();
+    if (buffer.none()) {
+        cs120_warn("package lost!");
+        return;
+    }
+
+    // the window of a segment with syn is never scaled
+    uint16_t window = std::min<size_t>(receive_size - 1, std::numeric_limits<uint16_t>::max());
+
+    TCPHeader::generate((*buffer)[Range{}], 0,
+                        IPV4IdentificationGenerator::get().next(local.ip_addr, remote.ip_addr,
+                                                                IPV4Protocol::TCP),
+                        local.ip_addr, remote.ip_addr, 64,
+                        local.port, remote.port, isn, tcp_header.get_sequence() + 1,
+                        false, false, false, false, true, false, false, true, false,
+                        window, sync_option.into_slice(), 0);
+}
+
+TCPAcceptor::TimePoint TCPAcceptor::poll(TimePoint current) {
+    if (finished) { return TimePoint::max(); }
+
+    if (closed || send_queue.is_closed()) {
+        finish();
+        return TimePoint::max();
+    }
+
+    for (;;) {
+        auto buffer = recv_queue->try_recv();
+        if (buffer.none()) { break; }
+
+        accept((*buffer)[Range{}], buffer->segment_size, current);
+    }
+
+    bool moved = false;
+
+    size_t room = 0;
+    {
+        std::unique_lock<std::mutex> guard{lock};
+        room = accept_backlog - std::min(accepted.size(), accept_backlog);
+    }
+
+    held = 0;
+
+    for (auto ptr = syncing.begin(); ptr != syncing.end();) {
+        if (ptr->connection->is_connecting()) {
+            ++ptr;
+            continue;
         }
 
-        TCPOptionIter iter{tcp_option};
-        // todo
-        for (auto item = iter.next(); !iter.is_end(item); item = iter.next()) {
-            auto[op, data] = item;
-
-            switch (op) {
-                case TCPOption::End:
-                    break;
-                case TCPOption::NoOperation:
-                    break;
-                case TCPOption::MaximumSegmentSize:
-                    remote_mss = (static_cast<uint16_t>(data[0]) << 8) |
-                                 (static_cast<uint16_t>(data[1]) << 0);
-                    break;
-                case TCPOption::WindowScaleFactor:
-                    remote_scale = data[0];
-                    break;
-                case TCPOption::SACKPermitted:
-                    break;
-                case TCPOption::SACK:
-                    break;
-                case TCPOption::Echo:
-                    break;
-                case TCPOption::EchoReply:
-                    break;
-                case TCPOption::Timestamp:
-                    break;
-                default:
-                    cs120_warn("unknown tcp option type!");
+        // a handshake which gave up is just dropped
+        if (!ptr->connection->is_finished()) {
+            // `pop` wakes the worker once there is room again
+            if (room == 0) {
+                ++held;
+                ++ptr;
+                continue;
             }
+
+            std::unique_lock<std::mutex> guard{lock};
+            accepted.push_back(std::move(*ptr));
+            --room;
+            moved = true;
         }
 
-        if (ack && sync) { break; }
+        ptr = syncing.erase(ptr);
     }
 
-    sender = std::shared_ptr<TCPSender>(new TCPSender{
-            local, remote, local_seq, remote_seq, local_mss, local_scale, remote_window
-    });
-    receiver = std::shared_ptr<TCPReceiver>(new TCPReceiver{
-            local, remote, local_seq, remote_seq, remote_mss, remote_scale
-    });
+    if (moved) {
+        std::unique_lock<std::mutex> guard{lock};
+        ready.notify_all();
+        if (waker != nullptr) { waker->wake(token); }
+    }
 
-    auto[request_send, request_recv] = MPSCQueue<Request>::channel(size);
+    // forget the remotes whose connections are gone, once the map has doubled
+    if (remotes.size() > 2 * sweep_size) {
+        for (auto ptr = remotes.begin(); ptr != remotes.end();) {
+            ptr = ptr->second.expired() ? remotes.erase(ptr) : std::next(ptr);
+        }
+
+        sweep_size = std::max<size_t>(remotes.size(), 16);
+    }
 
-    request_sender = request_send;
+    return TimePoint::max();
+}
 
-    auto *send_args = new TCPSendArgs{
-            .send_queue = std::move(send),
-            .request_receiver = std::move(request_recv),
-            .connection = sender,
+void TCPAcceptor::finish() {
+    auto close = [](Entry &entry) {
+        auto send = entry.requests.try_send();
+        if (!send.none()) { *send = TCPClient::Request{TCPClient::Request::Close, {.close = {}}}; }
     };
 
-    auto *recv_args = new TCPRecvArgs{
-            .recv_queue = std::move(recv),
-            .request_sender = std::move(request_send),
-            .connection = receiver,
-    };
+    for (auto &entry: syncing) { close(entry); }
+    syncing.clear();
+
+    std::unique_lock<std::mutex> guard{lock};
+    for (auto &entry: accepted) { close(entry); }
+    accepted.clear();
+
+    finished = true;
+    ready.notify_all();
+    if (waker != nullptr) { waker->wake(token); }
+}
+
+bool TCPAcceptor::pop(Entry &entry, bool block) {
+    std::unique_lock<std::mutex> guard{lock};
+
+    while (block && accepted.empty() && !finished) { ready.wait(guard); }
+    if (accepted.empty()) { return false; }
+
+    entry = std::move(accepted.front());
+    accepted.pop_front();
+
+    // for the connections held back in `syncing`
+    if (worker_waker != nullptr) { worker_waker->wake(worker_token); }
+
+    return true;
+}
+
+void TCPAcceptor::set_waker(std::shared_ptr<Waker> value, size_t value_token) {
+    std::unique_lock<std::mutex> guard{lock};
+    waker = std::move(value);
+    token = value_token;
+
+    if (waker != nullptr) { waker->wake(token); }
+}
+
+void TCPAcceptor::close() {
+    closed = true;
+
+    std::unique_lock<std::mutex> guard{lock};
+    if (worker_waker != nullptr) { worker_waker->wake(worker_token); }
+}
+
+
+TCPListener::TCPListener(std::shared_ptr<BaseSocket> &device, size_t size, EndPoint local,
+                         size_t sync_backlog, size_t accept_backlog, size_t send_size,
+                         size_t receive_size, TCPCongestionAlgorithm congestion,
+                         TCPEngine &engine) :
+        device{device}, acceptor{std::make_shared<TCPAcceptor>(
+                device, size, local, sync_backlog, accept_backlog, send_size, receive_size,
+                congestion, engine)} {
+    engine.add(acceptor);
+}
+
+TCPClient TCPListener::into_client(TCPAcceptor::Entry &&entry) {
+    return TCPClient{device, std::move(entry.connection), std::move(entry.requests)};
+}
+
+TCPClient TCPListener::accept() {
+    TCPAcceptor::Entry entry{};
+    if (!acceptor->pop(entry, true)) { return TCPClient{}; }
+
+    return into_client(std::move(entry));
+}
+
+TCPClient TCPListener::try_accept() {
+    TCPAcceptor::Entry entry{};
+    if (!acceptor->pop(entry, false)) { return TCPClient{}; }
 
-    pthread_create(&send_thread, nullptr, tcp_sender, send_args);
-    pthread_create(&recv_thread, nullptr, tcp_receiver, recv_args);
+    return into_client(std::move(entry));
 }
 }
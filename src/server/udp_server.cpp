@@ -10,8 +10,9 @@ UDPServer::UDPServer(std::shared_ptr<BaseSocket> &device, size_t size,
                      uint32_t src_ip, uint32_t dest_ip, uint16_t src_port, uint16_t dest_port) :
         device{device}, send_queue{}, recv_queue{},
         src_ip{src_ip}, dest_ip{dest_ip}, src_port{src_port}, dest_port{dest_port},
+        header{0, src_ip, dest_ip, 64, src_port, dest_port},
         receive_buffer{device->get_mtu()},
-        receive_buffer_slice{}, identifier{1} {
+        receive_buffer_slice{} {
     auto[send, recv] = device->bind([=](auto ip_header, auto ip_option, auto ip_data) {
         (void) ip_option;
 
@@ -35,49 +36,85 @@ UDPServer::UDPServer(std::shared_ptr<BaseSocket> &device, size_t size,
     recv_queue = std::move(recv);
 }
 
-size_t UDPServer::send(Slice<uint8_t> data) {
-    size_t length = data.size();
+void UDPServer::generate(MutSlice<uint8_t> frame, Slice<Slice<uint8_t>> data, size_t size,
+                         size_t &index, size_t &offset) {
+    auto &identification = IPV4IdentificationGenerator::get();
+
+    auto payload = header.generate(frame, identification.next(src_ip, dest_ip, IPV4Protocol::UDP),
+                                   size);
+
+    // gathered straight into the datagram
+    for (size_t filled = 0; filled < size;) {
+        size_t len = std::min(data[index].size() - offset, size - filled);
+
+        if (len > 0) {
+            (*payload)[Range{filled}][Range{0, len}]
+                    .copy_from_slice(data[index][Range{offset}][Range{0, len}]);
+        }
+
+        filled += len;
+        offset += len;
+
+        if (offset == data[index].size()) {
+            ++index;
+            offset = 0;
+        }
+    }
+}
+
+ssize_t UDPServer::transmit(Slice<Slice<uint8_t>> data, bool block) {
+    size_t length = 0;
+    for (auto &slice: data) { length += slice.size(); }
 
     size_t maximum = UDPHeader::max_payload(device->get_mtu());
 
-    while (!data.empty()) {
-        auto buffer = send_queue.send();
-        if (buffer.none()) { return 0; }
+    // position in `data` of the next byte to go
+    size_t index = 0, offset = 0;
 
-        size_t size = std::min(maximum, data.size());
+    for (size_t remain = length, size; remain > 0; remain -= size) {
+        auto buffer = block ? send_queue.send() : send_queue.try_send();
+        if (buffer.none()) {
+            if (!buffer.is_empty()) { return 0; }
 
-        {
-            UDPHeader::generate((*buffer)[Range{}], 0, identifier, src_ip, dest_ip,
-                                src_port, dest_port, 64, size)
-                    ->copy_from_slice(data[Range{0, size}]);
+            return remain < length ? static_cast<ssize_t>(length - remain) : -1;
         }
 
-        data = data[Range{size}];
+        size = std::min(maximum, remain);
 
-        ++identifier;
+        generate((*buffer)[Range{}], data, size, index, offset);
     }
 
     return length;
 }
 
-size_t UDPServer::recv(MutSlice<uint8_t> data) {
-    auto last_size = receive_buffer_slice.size();
-
-    if (last_size > 0) {
-        if (last_size > data.size()) {
-            data.copy_from_slice(receive_buffer_slice[Range{0, data.size()}]);
-            receive_buffer_slice = receive_buffer_slice[Range{data.size()}];
-            return data.size();
-        } else {
-            data[Range{0, last_size}].copy_from_slice(receive_buffer_slice);
-            receive_buffer_slice = MutSlice<uint8_t>{};
-            return last_size;
-        }
+namespace {
+/// copy `data` over `slices` one after another, returning how much fits
+size_t scatter(Slice<uint8_t> data, Slice<MutSlice<uint8_t>> slices) {
+    size_t size = 0;
+
+    for (auto slice: slices) {
+        size_t len = std::min(slice.size(), data.size() - size);
+        if (len > 0) { slice[Range{0, len}].copy_from_slice(data[Range{size}][Range{0, len}]); }
+
+        size += len;
+        if (size == data.size()) { break; }
+    }
+
+    return size;
+}
+}
+
+ssize_t UDPServer::receive(Slice<MutSlice<uint8_t>> data, bool block) {
+    if (!receive_buffer_slice.empty()) {
+        size_t size = scatter(receive_buffer_slice, data);
+        receive_buffer_slice = size == receive_buffer_slice.size() ? MutSlice<uint8_t>{} :
+                               receive_buffer_slice[Range{size}];
+        return size;
     }
 
     for (;;) {
-        auto buffer = recv_queue->recv();
-        if (buffer.none()) { return 0; }
+        auto buffer = block ? recv_queue->recv() : recv_queue->try_recv();
+        if (buffer.none()) { return buffer.is_empty() ? -1 : 0; }
 
         auto *ip_header = buffer->buffer_cast<IPV4Header>();
         if (ip_header == nullptr || complement_checksum(ip_header->into_slice()) != 0) {
@@ -95,15 +132,15 @@ size_t UDPServer::recv(MutSlice<uint8_t> data) {
             continue;
         }
 
-        if (udp_data.size() > data.size()) {
-            data.copy_from_slice(udp_data[Range{0, data.size()}]);
-            receive_buffer_slice = receive_buffer[Range{0, udp_data.size() - data.size()}];
-            receive_buffer_slice.copy_from_slice(udp_data[Range{data.size()}]);
-            return data.size();
-        } else {
-            data[Range{0, udp_data.size()}].copy_from_slice(udp_data);
-            return udp_data.size();
+        size_t size = scatter(udp_data, data);
+
+        // the rest is kept for the next call
+        if (size < udp_data.size()) {
+            receive_buffer_slice = receive_buffer[Range{0, udp_data.size() - size}];
+            receive_buffer_slice.copy_from_slice(udp_data[Range{size}]);
         }
+
+        return size;
     }
 }
 }
@@ -0,0 +1,116 @@
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "device/base_socket.hpp"
+#include "server/async.hpp"
+
+
+using namespace cs120;
+using namespace std::chrono_literals;
+
+
+static int failures = 0;
+
+static void check(bool value, const char *message) {
+    if (!value) {
+        fprintf(stderr, "failed: %s\n", message);
+        ++failures;
+    }
+}
+
+/// a device that hands what is sent on it back to its own filters, from a thread of its own
+class LoopbackSocket : public BaseSocket {
+private:
+    Demultiplexer<PacketBuffer> demultiplexer;
+    Demultiplexer<PacketBuffer>::RequestSender recv_queue;
+    MPSCQueue<PacketBuffer>::Sender send_queue;
+    std::atomic<bool> stop;
+    std::thread worker;
+
+public:
+    explicit LoopbackSocket(size_t size) :
+            demultiplexer{size}, recv_queue{}, send_queue{}, stop{false}, worker{} {
+        auto[sender, receiver] = MPSCQueue<PacketBuffer>::channel(size);
+
+        recv_queue = demultiplexer.get_sender();
+        send_queue = std::move(sender);
+
+        worker = std::thread{[this, receiver = std::move(receiver)]() mutable {
+            while (!stop.load()) {
+                auto buffer = receiver.recv_timeout(10ms);
+                if (buffer.none()) { continue; }
+
+                demultiplexer.send((*buffer)[Range{}], buffer->segment_size);
+            }
+        }};
+    }
+
+    uint16_t get_mtu() final { return 1500; }
+
+    std::pair<MPSCQueue<PacketBuffer>::Sender, Demultiplexer<PacketBuffer>::ReceiverGuard>
+    bind(Demultiplexer<PacketBuffer>::Condition &&condition, size_t size) final {
+        return std::make_pair(send_queue, recv_queue.send(std::move(condition), size));
+    }
+
+    ~LoopbackSocket() override {
+        stop.store(true);
+        worker.join();
+    }
+};
+
+static AsyncTask echo(AsyncLoop &loop, UDPServer &server) {
+    uint8_t buffer[64];
+
+    ssize_t size = co_await loop.recv(server, MutSlice<uint8_t>{buffer, sizeof(buffer)});
+    if (size <= 0) { co_return; }
+
+    co_await loop.send(server, Slice<uint8_t>{buffer, static_cast<size_t>(size)});
+}
+
+static AsyncTask request(AsyncLoop &loop, UDPServer &server, Slice<uint8_t> data,
+                         MutSlice<uint8_t> reply, ssize_t &size) {
+    co_await loop.send(server, data);
+    size = co_await loop.recv(server, reply);
+}
+
+/// two coroutines on one loop, each waiting on its own endpoint, pass a datagram back and forth
+static void test_echo() {
+    constexpr uint32_t CLIENT = 0x0100000a, SERVER = 0x0200000a;
+
+    std::shared_ptr<BaseSocket> device{new LoopbackSocket{64}};
+
+    UDPServer client{device, 16, CLIENT, SERVER, 4000, 5000};
+    UDPServer server{device, 16, SERVER, CLIENT, 5000, 4000};
+
+    AsyncLoop loop{};
+    loop.add(client);
+    loop.add(server);
+
+    const char message[] = "hello";
+    uint8_t reply[64]{};
+    ssize_t size = -1;
+
+    echo(loop, server);
+    request(loop, client, Slice<uint8_t>{reinterpret_cast<const uint8_t *>(message),
+                                         sizeof(message)},
+            MutSlice<uint8_t>{reply, sizeof(reply)}, size);
+
+    loop.run();
+
+    check(size == static_cast<ssize_t>(sizeof(message)), "the reply is as long as the request");
+    check(memcmp(reply, message, sizeof(message)) == 0, "the reply is the request echoed");
+
+    loop.remove(server);
+    loop.remove(client);
+}
+
+int main() {
+    test_echo();
+
+    if (failures == 0) { printf("async ok\n"); }
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,51 @@
+#include <cstdio>
+#include <vector>
+
+#include "server/tcp_server.hpp"
+
+
+using namespace cs120;
+
+
+static int failures = 0;
+
+static void check(bool value, const char *message) {
+    if (!value) {
+        fprintf(stderr, "failed: %s\n", message);
+        ++failures;
+    }
+}
+
+/// once the ranges of out of order data fill the table, data in order still goes through
+static void test_full_table() {
+    constexpr uint32_t ISN = 1000;
+
+    // room for 256 / 128 + 1 = 3 ranges
+    TCPReceiver receiver{{}, {}, 0, ISN, 128, 0, 256, true, false, 0};
+
+    std::vector<uint8_t> byte(1, 'x');
+    Slice<uint8_t> data{byte.data(), byte.size()};
+
+    for (uint32_t offset: {10, 20, 30}) { receiver.accept(ISN + offset, data); }
+    check(receiver.fragments.size() == 3, "three holes are tracked");
+
+    receiver.accept(ISN + 40, data);
+    check(receiver.fragments.size() == 3, "a fourth hole is dropped");
+
+    receiver.accept(ISN, data);
+    check(receiver.frame_receive == ISN + 1, "data in order is taken with the table full");
+    check(receiver.buffer.readable() == 1, "data in order is readable");
+
+    std::vector<uint8_t> fill(9, 'y');
+    receiver.accept(ISN + 1, Slice<uint8_t>{fill.data(), fill.size()});
+    check(receiver.frame_receive == ISN + 11, "the first range held joins data in order");
+    check(receiver.fragments.size() == 2, "the ranges drain from the front");
+}
+
+int main() {
+    test_full_table();
+
+    if (failures == 0) { printf("tcp receiver ok\n"); }
+
+    return failures == 0 ? 0 : 1;
+}
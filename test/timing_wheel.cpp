@@ -0,0 +1,61 @@
+#include <cstdio>
+#include <chrono>
+#include <vector>
+
+#include "timing_wheel.hpp"
+
+
+using namespace cs120;
+using namespace std::chrono_literals;
+
+using Wheel = TimingWheel<int>;
+
+
+static int failures = 0;
+
+static void check(bool value, const char *message) {
+    if (!value) {
+        fprintf(stderr, "failed: %s\n", message);
+        ++failures;
+    }
+}
+
+/// a timer left in the current slot of a higher level, not cascaded yet, is the next one
+static void test_uncascaded_slot() {
+    Wheel wheel{};
+    auto start = Wheel::Clock::now();
+
+    wheel.schedule(1, start + 100ms);
+    wheel.schedule(2, start + 200ms);
+
+    // up to the last tick before the slot of the first timer turns over
+    wheel.advance(start + 63ms, [](int) { check(false, "nothing fires by 63 ms"); });
+
+    check(wheel.next_deadline() <= start + 101ms, "the timer at 100 ms comes first");
+}
+
+static void test_order() {
+    Wheel wheel{};
+    auto start = Wheel::Clock::now();
+
+    std::vector<int> fired{};
+    for (int i = 0; i < 8; ++i) { wheel.schedule(i, start + (7 - i) * 700ms + 5ms); }
+
+    for (auto time = start; !wheel.empty(); time = wheel.next_deadline()) {
+        check(time < start + 6s, "the deadlines are reached");
+        if (time >= start + 6s) { break; }
+
+        wheel.advance(time, [&](int key) { fired.push_back(key); });
+    }
+
+    check(fired == std::vector<int>{7, 6, 5, 4, 3, 2, 1, 0}, "timers fire in deadline order");
+}
+
+int main() {
+    test_uncascaded_slot();
+    test_order();
+
+    if (failures == 0) { printf("timing wheel ok\n"); }
+
+    return failures == 0 ? 0 : 1;
+}